@@ -317,15 +317,6 @@ constexpr auto channel_map_from524 = modified(channel_map_original, {{32, std::n
 constexpr auto channel_map_from537 = modified(channel_map_from524, {{95, PhysLoc{5, 5, 'S'}},
                                                                     {127, PhysLoc{3, 14, 'C'}}});
 
-[[nodiscard]] inline const auto& get_channel_map(unsigned int run) noexcept {
-    if (run >= 537) {
-        return channel_map_from537;
-    } else if (run >= 524) {
-        return channel_map_from524;
-    }
-    return channel_map_original;
-}
-
 // this is the desired ordering of the cells
 constexpr std::array<PhysLoc, NPMT> cell_ordering = {{{1, 5, 'S'}, {1, 5, 'C'},  // 0, 1
                                                       {1, 6, 'S'},
@@ -474,12 +465,12 @@ constexpr std::array<PhysLoc, NPMT> cell_ordering = {{{1, 5, 'S'}, {1, 5, 'C'},
  * result = [1, 3, 5]  // 5 is invalid index
  */
 template <typename T, std::size_t N, std::size_t M>
-std::array<std::size_t, M> make_index_map(
+constexpr std::array<std::size_t, M> make_index_map(
     const std::array<std::optional<T>, N>& original,
     const std::array<T, M>& target_ordered,
     std::size_t invalid_index = N) {
     std::array<std::size_t, M> indices{};
-    indices.fill(invalid_index);
+    for (auto& index : indices) index = invalid_index;  // std::array::fill is constexpr only from c++20
 
     // N x M complexity, can be improved with hash map to N + M
     for (std::size_t j = 0; j < M; ++j) {
@@ -496,16 +487,12 @@ std::array<std::size_t, M> make_index_map(
     return indices;
 }
 
-const auto map_hw_to_index_original = make_index_map(channel_map_original, cell_ordering);
-const auto map_hw_to_index_from524 = make_index_map(channel_map_from524, cell_ordering);
-const auto map_hw_to_index_from537 = make_index_map(channel_map_from537, cell_ordering);
-
 template <std::size_t N, std::size_t M>
 constexpr std::array<std::size_t, M> make_inverse_map(
     const std::array<std::size_t, N>& index_map,
     std::size_t invalid_index = M) {
     std::array<std::size_t, M> inv{};
-    inv.fill(invalid_index);
+    for (auto& index : inv) index = invalid_index;
 
     for (std::size_t i = 0; i < N; ++i) {
         const std::size_t j = index_map[i];
@@ -516,26 +503,57 @@ constexpr std::array<std::size_t, M> make_inverse_map(
     return inv;
 }
 
-const auto map_hw_to_index_original_inv = make_inverse_map<NPMT, NCHANNEL>(map_hw_to_index_original);
-const auto map_hw_to_index_from524_inv = make_inverse_map<NPMT, NCHANNEL>(map_hw_to_index_from524);
-const auto map_hw_to_index_from537_inv = make_inverse_map<NPMT, NCHANNEL>(map_hw_to_index_from537);
+/// One mapping configuration, from first_run up to the first run of the next one. All its tables are
+/// computed at compile time
+struct Configuration {
+    unsigned int first_run;
+    std::array<std::optional<PhysLoc>, NCHANNEL> channel_map;
+    std::array<std::size_t, NPMT> idx_to_hw;      ///< NCHANNEL if the cell is not read out
+    std::array<std::size_t, NCHANNEL> hw_to_idx;  ///< NCHANNEL if the channel is not a PMT
+};
+
+constexpr Configuration make_configuration(unsigned int first_run, const std::array<std::optional<PhysLoc>, NCHANNEL>& channel_map) {
+    const auto idx_to_hw = make_index_map(channel_map, cell_ordering);
+    return {first_run, channel_map, idx_to_hw, make_inverse_map<NPMT, NCHANNEL>(idx_to_hw)};
+}
+
+/// Registry of the configurations, sorted by first run. A new mapping is one more line here
+inline constexpr std::array<Configuration, 3> configurations = {{
+    make_configuration(0, channel_map_original),
+    make_configuration(524, channel_map_from524),
+    make_configuration(537, channel_map_from537)
+}};
+
+static_assert(configurations[0].first_run == 0, "The first configuration must start from run 0");
+
+[[nodiscard]] constexpr std::size_t get_configuration_index(unsigned int run) noexcept {
+    std::size_t i = configurations.size() - 1;
+    while (i > 0 && run < configurations[i].first_run) --i;
+    return i;
+}
+
+[[nodiscard]] constexpr const Configuration& get_configuration(unsigned int run) noexcept {
+    return configurations[get_configuration_index(run)];
+}
+
+// Names of the tables before the registry
+inline constexpr const auto& map_hw_to_index_original = configurations[0].idx_to_hw;
+inline constexpr const auto& map_hw_to_index_from524 = configurations[1].idx_to_hw;
+inline constexpr const auto& map_hw_to_index_from537 = configurations[2].idx_to_hw;
+inline constexpr const auto& map_hw_to_index_original_inv = configurations[0].hw_to_idx;
+inline constexpr const auto& map_hw_to_index_from524_inv = configurations[1].hw_to_idx;
+inline constexpr const auto& map_hw_to_index_from537_inv = configurations[2].hw_to_idx;
+
+[[nodiscard]] inline const auto& get_channel_map(unsigned int run) noexcept {
+    return get_configuration(run).channel_map;
+}
 
 [[nodiscard]] inline const auto& get_map_hw_to_index(unsigned int run) noexcept {
-    if (run >= 537) {
-        return map_hw_to_index_from537;
-    } else if (run >= 524) {
-        return map_hw_to_index_from524;
-    }
-    return map_hw_to_index_original;
+    return get_configuration(run).idx_to_hw;
 }
 
 [[nodiscard]] inline const auto& get_map_hw_to_index_inv(unsigned int run) noexcept {
-    if (run >= 537) {
-        return map_hw_to_index_from537_inv;
-    } else if (run >= 524) {
-        return map_hw_to_index_from524_inv;
-    }
-    return map_hw_to_index_original_inv;
+    return get_configuration(run).hw_to_idx;
 }
 
 constexpr unsigned int rowFromIdx(idx_t idx) {
@@ -559,6 +577,26 @@ constexpr double row2Y(unsigned int row) noexcept {
     return std::to_string(col) + ((row >= 10) ? std::to_string(row) : ("0" + std::to_string(row)));
 }
 
+/// Geometry of the cell of each index, independent of the run
+struct CellGeometry {
+    PhysLoc cell;
+    double x;
+    double y;
+    std::array<char, 4> name;  ///< same as cellName, nul terminated
+};
+
+constexpr std::array<CellGeometry, NPMT> make_cell_geometry() {
+    std::array<CellGeometry, NPMT> geometry{};
+    for (std::size_t idx = 0; idx < NPMT; ++idx) {
+        const PhysLoc cell = cell_ordering[idx];
+        geometry[idx] = {cell, column2X(cell.column), row2Y(cell.row),
+                         {char('0' + cell.column), char('0' + cell.row / 10), char('0' + cell.row % 10), '\0'}};
+    }
+    return geometry;
+}
+
+inline constexpr std::array<CellGeometry, NPMT> cell_geometry = make_cell_geometry();
+
 }  // namespace details
 
 /** Convert the index of the array [0-123] to the PMT channel [0-127]
@@ -578,12 +616,17 @@ constexpr double row2Y(unsigned int row) noexcept {
 }
 
 [[nodiscard]] inline PhysInfo getPhysInfoFromIdx(const idx_t idx) {
-    const PhysLoc cell = details::cell_ordering[idx];
-    return {cell.column, cell.row, cell.type, details::column2X(cell.column), details::row2Y(cell.row), details::cellName(cell.row, cell.column)};
+    const details::CellGeometry& geometry = details::cell_geometry[idx];
+    return {geometry.cell.column, geometry.cell.row, geometry.cell.type, geometry.x, geometry.y, geometry.name.data()};
 }
 
 [[nodiscard]] inline PhysInfo getPhysInfoFromHWLoc(HWLoc hw, unsigned int run) {
-    const auto maybe_cell = details::get_channel_map(run)[hw.ch];
+    const details::Configuration& configuration = details::get_configuration(run);
+    const std::size_t idx = configuration.hw_to_idx[hw.ch];
+    if (idx < NPMT) {
+        return getPhysInfoFromIdx(idx);
+    }
+    const auto maybe_cell = configuration.channel_map[hw.ch];
     if (not maybe_cell) {
         throw std::out_of_range("Channel " + std::to_string(hw.ch) + " is not mapped to any cell");
     }
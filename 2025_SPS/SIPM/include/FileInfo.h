@@ -11,7 +11,6 @@
 #include <fstream>
 #include <cstdint>
 #include <cstddef>
-#include <map>
 #include <vector>
 #include <limits>
 
@@ -28,14 +27,50 @@
 ##
 ##***************************************************/
 
-typedef std::map<long, std::vector<std::uint64_t>> TrigIndexMap;
+// Where a fragment sits in the file, as found by the index scan
+struct FragmentRecord
+{
+    long trigID;
+    uint64_t offset; // where the fragment begins in the file
+    uint16_t size;
+    uint8_t boardID;
+};
+
+// Flat index of the fragments grouped by trigger ID, sorted by trigger ID. 
+// All fragments are stored in a single contiguous array, and the fragments of 
+// the i-th trigger are the ones between m_first[i] and m_first[i+1] (CSR layout)
+
+class TrigIndex
+{
+    public:
+    void Clear();
+    void Reserve(std::size_t nFragments) {m_fragments.reserve(nFragments);}
+    void Add(const FragmentRecord & l_record) {m_fragments.push_back(l_record);}
+    void Finalize(); // groups the fragments by trigger ID - to be called once all fragments are added
+
+    std::size_t NTriggers() const {return m_trigIDs.size();}
+    std::size_t NFragments() const {return m_fragments.size();}
+    long TrigID(std::size_t i) const {return m_trigIDs[i];}
+    const std::vector<long> & TrigIDs() const {return m_trigIDs;}
+    std::size_t NFragments(std::size_t i) const {return m_first[i+1] - m_first[i];}
+    const FragmentRecord * FragmentsBegin(std::size_t i) const {return m_fragments.data() + m_first[i];}
+    const FragmentRecord * FragmentsEnd(std::size_t i) const {return m_fragments.data() + m_first[i+1];}
+    long Find(long trigID) const; // position of trigID in the index, -1 if not there
+
+    private:
+    std::vector<FragmentRecord> m_fragments;
+    std::vector<long> m_trigIDs;
+    std::vector<std::size_t> m_first;
+};
 
 class FileInfo
 {
 
     public: 
     FileInfo();
-    ~FileInfo(){};
+    ~FileInfo();
+    FileInfo(const FileInfo &) = delete; // owns the file mapping, not copyable
+    FileInfo & operator=(const FileInfo &) = delete;
     bool ReadHeader(); // reads and stores the file header information
     
     // Left public because they will have to be accessed 
@@ -53,29 +88,55 @@ class FileInfo
 
     bool ReadEvent(SiPMEvent & l_event);
     bool ReadEventFragment(SiPMEvent & l_event);  
+    bool SkipEventFragment(); // moves to the next fragment without decoding the current one
     bool ReadTrigID(long trigID, SiPMEvent & l_event); // read all fragments corresponding to a given trigID and store them in the event
+    bool ReadTrigger(std::size_t i, SiPMEvent & l_event); // same as ReadTrigID, for the i-th trigger of the index
+    // Same as ReadTrigger, but does not touch the state of FileInfo, so that different threads can decode 
+    // different triggers at the same time. Only available if the file is memory-mapped
+    bool DecodeTrigger(std::size_t i, SiPMEvent & l_event) const;
 
     long GetNextTriggerID(); // If the file is at the beginning of an event, peeks at the next trigID without changing the current position of the file 
     uint16_t GetEventSize(); // If the file is at the beginning of an event, peeks at the size of the event without changing the current position of the file 
     
-    bool BuildTrigIDMap(); // Scans the whole file and builds m_index 
-    std::ifstream * InputFile() {return &m_inputfile;}
-    bool OpenFile(std::string filename); // Opens the input file
-    const TrigIndexMap & GetIndexMap() const {return m_index;}  
+    bool BuildTrigIDMap(); // Scans the whole file once and builds m_index 
+    bool OpenFile(std::string filename, bool useMemoryMap = true); // Opens the input file, memory-mapping it if possible
+    bool AtEnd() const {return m_cursor >= m_filesize;} // true if there is no further fragment to be read
+    bool IsMemoryMapped() const {return m_map != nullptr;}
+    const TrigIndex & GetIndex() const {return m_index;}  
+    const FragmentFormat & GetFragmentFormat() const {return m_format;}
     void PrintMap() const;
 
     private: 
 
-        // a pointer to the input file
+        // Copies n bytes starting at offset into dst, without moving m_cursor
+        bool PeekBytes(uint64_t offset, void * dst, std::size_t n);
+        // Returns a pointer to the size bytes starting at offset. This points directly
+        // into the mapping if the file is memory-mapped, to m_buffer otherwise
+        const char * FragmentAt(uint64_t offset, uint16_t size);
+        // Looks at the first fragment to find out if all channels share the same type (the normal case)
+        void DetectUniformLayout();
+        // Stream backend only: makes sure that m_buffer contains the n bytes starting at offset
+        bool FillBuffer(uint64_t offset, std::size_t n);
+
+        // The input file. Only used if the file cannot be memory-mapped
         std::ifstream m_inputfile;
         std::string m_filename;
         uint64_t m_filesize;
 
-        // The map of where all fragments corresponding to the same trigID start
-        // The keys are trigID 
-        // The payload is a vector of ints (where the event begins in the file)
+        // Read-only view of the whole file (nullptr if the stream backend is used)
+        const char * m_map;
+        // Offset in the file of the next fragment to be read
+        uint64_t m_cursor;
+        // Read-ahead buffer for the stream backend, holding the file bytes from m_bufferStart on
+        std::vector<char> m_buffer;
+        uint64_t m_bufferStart;
+
+        // The index of where all fragments corresponding to the same trigID start
+
+        TrigIndex m_index; 
 
-        TrigIndexMap m_index; 
+        // What is needed to decode the fragments of this file
+        FragmentFormat m_format;
     
 };
 
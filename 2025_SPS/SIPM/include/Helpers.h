@@ -5,6 +5,8 @@
 #include <string>
 #include <iostream>
 #include <iomanip>
+#include <sstream>
+#include <atomic>
 
 #include <cstdint>
 #include <cstring>   
@@ -28,11 +30,47 @@ inline uint8_t g_getBoardId(uint32_t index){
 inline uint8_t g_getChannelId(uint32_t index){
   return index % NCHANNELS;
 } 
-void printToHex(const char* data, std::size_t n);
 void g_setVerbosity(const Verbose level);
 Verbose g_getVerbosity(); 
 void logging(const std::string&, const Verbose);
 
+// Defined in Helpers.cxx, shared by all the decoders in the process
+extern std::atomic<Verbose> VERBOSE;
+
+// True if a message at this level would be printed. With SIPM_NO_PEDANTIC_LOGGING (CMake option 
+// SIPM_PEDANTIC_LOGGING=OFF) it is false at compile time for kPedantic, so that pedantic logging disappears
+inline bool g_isLogged(const Verbose level)
+{
+#ifdef SIPM_NO_PEDANTIC_LOGGING
+  if (level == Verbose::kPedantic) return false;
+#endif
+  const Verbose l_verbose = VERBOSE.load(std::memory_order_relaxed);
+  return (int)level <= (int)l_verbose || l_verbose == Verbose::kPedantic;
+}
+
+// Streams the arguments of the lazy logging. Small integers are printed as numbers, not characters
+template <class T>
+inline void g_logArg(std::ostream & os, const T & arg) {os << arg;}
+inline void g_logArg(std::ostream & os, const uint8_t & arg) {os << static_cast<unsigned int>(arg);}
+inline void g_logArg(std::ostream & os, const int8_t & arg) {os << static_cast<int>(arg);}
+
+// Lazy logging: the message is built from args only if the level is printed, e.g.
+// logging(Verbose::kPedantic, "Channel ", chID, ": HG ", m_HG[chID]);
+template <class... Args>
+inline void logging(const Verbose level, const Args &... args)
+{
+  if (!g_isLogged(level)) return;
+  std::ostringstream oss;
+  (g_logArg(oss, args), ...);
+  logging(oss.str(), level);
+}
+
+void printToHexUnchecked(const char* data, std::size_t n);
+inline void printToHex(const char* data, std::size_t n)
+{
+  if (g_isLogged(Verbose::kPedantic)) printToHexUnchecked(data, n);
+}
+
 // Optimized by compiler (popcount = number of bits set to 1)
 inline uint8_t popcount(uint64_t x) {
   u_int8_t v = 0;
@@ -49,5 +87,14 @@ inline void read_le(T * v, const uint8_t*& p) {
     p += sizeof(T);
 }
 
+// Number of bytes following the channel ID and type in the payload of a channel of type chtype
+constexpr std::size_t channelPayloadSize(uint8_t chtype, int timeUnit) {
+  std::size_t size = 0;
+  if (chtype & CHTYPE_HAS_LG) size += 2;
+  if (chtype & CHTYPE_HAS_HG) size += 2;
+  if (chtype & CHTYPE_HAS_TOA) size += 4; // uint32_t or float
+  if (chtype & CHTYPE_HAS_TOT) size += (timeUnit == 1) ? 4 : 2; // float or uint16_t
+  return size;
+}
 
 #endif // #ifndef SIPM_DECODER_HELPERS_H
@@ -5,5 +5,8 @@
 
 // Expose your classes/structs to PyROOT:
 #pragma link C++ class SiPMDecoder+;   // the '+' generates I/O dict if ClassDef is used
+#pragma link C++ class SiPMSparseEvent+; // reader helpers for the sparse output layouts
+#pragma link C++ class SiPMAligner+; // SiPM/DAQ merging (DR_makeRootFiles.py)
+#pragma link C++ class SiPMOffsetFinder+; // SiPM/DAQ offset (DR_makeRootFiles.py)
 //#pragma link C++ class std::array<Channel,64>+; // example if you need STL containers
 #endif
\ No newline at end of file
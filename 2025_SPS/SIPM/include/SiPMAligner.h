@@ -0,0 +1,73 @@
+#ifndef SIPMDECODER_SIPMALIGNER_H
+#define SIPMDECODER_SIPMALIGNER_H
+
+#include "hardcoded.h"
+#include "SiPMEvent.h"
+#include "SiPMSparseEvent.h"
+
+// stl includes
+
+#include <string>
+#include <vector>
+
+// ROOT includes
+
+#include <TDirectory.h>
+#include <TTree.h>
+#include <Rtypes.h>
+
+/***************************************************
+## \file SiPMAligner.h
+## \brief: Aligns the SiPM events to the DAQ (PMT) events. Entry i of the
+##      aligned tree holds the SiPM trigger i + offset, or an empty placeholder
+##      (TrigID = -1) if that trigger was not recorded by the SiPM boards
+##
+##***************************************************/
+
+class SiPMAligner
+{
+public:
+  SiPMAligner();
+  ~SiPMAligner(){};
+
+  // Creates the aligned tree (SiPM_rawTree_aligned) in l_dir, with the same branches as the dense SiPM_rawTree
+  // but TrigID as Int_t and HG/LG as Short_t
+  bool BookOutput(TDirectory * l_dir, const std::string & l_name = "SiPM_rawTree_aligned");
+
+  // Appends one entry to the aligned tree: the content of l_event, or an empty placeholder if l_event is NULL
+  void Fill(const SiPMEvent * l_event);
+
+  // Full merge of one run: books the aligned tree in l_dir and fills it with nDaqEntries entries,
+  // taking the SiPM triggers from sipmTree (a SiPM_rawTree written by SiPMDecoder, in any output layout).
+  // The aligned tree is written to l_dir at the end
+  bool Align(TTree * sipmTree, Long64_t nDaqEntries, long offset, TDirectory * l_dir);
+  // Same, with an offset changing along the run (e.g. from SiPMOffsetFinder::FindSegments): 
+  // offsets[k] applies from the DAQ entry segmentStarts[k] on
+  bool Align(TTree * sipmTree, Long64_t nDaqEntries, const std::vector<Long64_t> & segmentStarts, const std::vector<long> & offsets, TDirectory * l_dir);
+
+  TTree * GetOutputTree() {return m_outTree;}
+  Long64_t GetNMatched() const {return m_nMatched;} // number of aligned entries with a SiPM trigger
+
+private:
+  // Sets the branch addresses of the input tree, returns false if it is not a Spectroscopy SiPM_rawTree
+  bool ConnectInput(TTree * l_tree);
+  // Reads l_entry of the input tree into m_event, rebuilding the dense arrays for the sparse layouts
+  void ReadEntry(Long64_t l_entry);
+
+  TTree * m_inTree;
+  OutputLayout m_inputLayout;
+
+  TTree * m_outTree;
+
+  // Buffer of the input tree. The output branches read from the same memory, so that the aligned
+  // tree is filled without copying what has just been read
+  SiPMEvent m_event;
+  SiPMSparseEvent m_sparseEvent;
+
+  // TrigID is an Int_t in the aligned tree
+  Int_t m_trigID;
+
+  Long64_t m_nMatched;
+};
+
+#endif // #ifndef SIPMDECODER_SIPMALIGNER_H
@@ -4,16 +4,20 @@
 #include <hardcoded.h>
 #include "FileInfo.h"
 #include "SiPMEvent.h"
+#include "SiPMSparseEvent.h"
+#include "SiPMAligner.h"
 #include "Helpers.h"
 
 // stl includes
 
 #include <string>
+#include <vector>
 
 // ROOT includes
 
 #include <TFile.h>
 #include <TTree.h>
+#include <Rtypes.h>
 
 /***************************************************
 ## \file SiPMDecoder 
@@ -31,8 +35,13 @@ class SiPMDecoder
     public:    
         SiPMDecoder(std::string filename = "");
         ~SiPMDecoder();
-        bool ConnectFile(std::string filename=""); // opens input file 
+        bool ConnectFile(std::string filename="", bool useMemoryMap = true); // opens input file (memory-mapped unless useMemoryMap is false)
         bool OpenOutput(std::string fname = "output.root"); // opens output file
+        // Writes the output to a file already opened by the caller (e.g. the merged file), instead of OpenOutput. 
+        // The decoder does not close nor delete it: call WriteOutput before closing the file
+        bool AttachOutput(TFile * file);
+        // Writes the trees to the output file. Done by the destructor for the files opened with OpenOutput
+        bool WriteOutput();
         bool ReadFileHeader(); // reads the file header and creates the metadata tree
         // Terminology is important. For Janus, and "event" is one acquisition on one board. 
         // So, teh same physical trigger read out on 4 board is 4 events. 
@@ -40,15 +49,76 @@ class SiPMDecoder
         // An "event" for me is one acquisition from all boards all corresponding to a given trigger ID
         // I will call an "Event Fragment" what Janus calls an event. It will be composed by an EventHeader and a payload. 
         bool Read(bool doEventBuilding = true); // reads the actual events and creates the SiPM tree 
-        void SetVerbosity(unsigned int level = 3);
+        void SetVerbosity(unsigned int level = 3); // the verbosity is shared by all the decoders in the process
+        // To be called once before running several decoders in different threads of the same process 
+        // (e.g. to convert several runs at the same time): makes ROOT thread-safe
+        static void EnableThreadSafety();
+        // Event building without indexing the whole file first: the file is read strictly sequentially, keeping at most 
+        // window triggers open. A trigger is written out as soon as expectedBoards fragments have been read for it 
+        // (if expectedBoards > 0), or when it is the oldest open trigger and a new one does not fit in the window.
+        // window = 0 goes back to the default (index-based) event building
+        void SetStreamingEventBuilding(unsigned int window = 64, unsigned int expectedBoards = 0);
+        // Number of threads used to decode the triggers in index-based event building (needs a memory-mapped input file).
+        // The events are still written to the tree in trigger order by the calling thread
+        void SetNThreads(unsigned int nThreads = 1) {m_nThreads = nThreads;}
+        // Output tuning, to be called before OpenOutput. Negative or zero values keep the ROOT defaults
+        // algorithm follows ROOT::RCompressionSetting::EAlgorithm (1 = zlib, 2 = lzma, 4 = lz4, 5 = zstd)
+        void SetCompression(int algorithm = -1, int level = -1) {m_compressionAlgorithm = algorithm; m_compressionLevel = level;}
+        void SetBasketSize(int basketSize = 0) {m_basketSize = basketSize;} // size in bytes of the baskets of each branch
+        void SetAutoFlush(Long64_t autoFlush = 0) {m_autoFlush = autoFlush;} // as TTree::SetAutoFlush: entries if > 0, bytes if < 0
+        // Enables ROOT implicit multithreading (nThreads = 0 means all cores), so that the baskets 
+        // of the output tree are compressed in parallel
+        void SetImplicitMT(unsigned int nThreads = 0);
+        // Layout of the SiPM data in the output tree, to be called before ReadFileHeader (Spectroscopy modes only): 
+        // 0 = dense 1024-channel arrays (default), 1 = only the boards present, 2 = only the channels above threshold. 
+        // SiPMSparseEvent has the helpers to rebuild the dense arrays from the compact ones
+        void SetOutputLayout(unsigned int layout = 0);
+        // Zero suppression: keeps the channels with HG > pedestal + nSigma * sigma (vectors indexed by boardID*64 + channel)
+        // and switches to layout 2. Returns false if the vectors do not have MAX_BOARDS*NCHANNELS entries
+        bool SetZeroSuppression(const std::vector<float> & pedestal, const std::vector<float> & sigma, float nSigma = 3.);
+        // Format of SiPM_rawTree, to be called before OpenOutput: 0 = TTree (default), 1 = RNTuple. RunMetaData stays a TTree.
+        // Returns false if the library was built without RNTuple support. The RNTuple pages are compressed with the 
+        // settings of SetCompression, and sealed in parallel if ROOT implicit multithreading is enabled (SetImplicitMT)
+        bool SetOutputFormat(unsigned int format = 0);
+        // Trigger IDs present in the file, in increasing order, from the index of the fragments (no decoding). 
+        // Reads the file header if needed. To be used to find the SiPM/DAQ offset before calling SetAlignment.
+        // Empty for Timing mode files, which have no trigger ID, and for Counting mode files unless enabled
+        std::vector<long> GetTriggerIDs();
+        // Fused decoding and alignment to the DAQ events (Spectroscopy modes only), to be called before OpenOutput 
+        // or AttachOutput: instead of SiPM_rawTree, the decoder writes SiPM_rawTree_aligned (see SiPMAligner) with 
+        // nDaqEntries entries, entry i holding the trigger i + offset or an empty placeholder. 
+        // Uses the index-based event building. nDaqEntries < 0 disables the alignment
+        void SetAlignment(Long64_t nDaqEntries, long offset);
+        // The Timing and Counting modes are decoded following the Janus documentation, but have not been checked 
+        // on a real Janus file yet: ReadFileHeader refuses them unless enabled here
+        void EnableTimingCountingModes(bool enable = true) {m_enableTimingCounting = enable;}
         // The dat input file itself 
 
         
     private: 
 
+        // Creates the branches of the data tree matching the acquisition mode of the input file
+        void BookDataBranches();
+
+        // Event building in streaming mode, see SetStreamingEventBuilding
+        bool ReadStreaming(unsigned int & eventCounter);
+        // Index-based event building with the decoding spread over m_nThreads threads
+        bool ReadParallel(unsigned int & eventCounter);
+        // Creates the output trees in m_outfile (OpenOutput and AttachOutput)
+        void BookOutputTrees();
+        // Fills the data tree with l_event, compacting it first if the output layout is not dense. Only what the 
+        // output reads is copied into m_event, and the hit vectors are swapped: l_event must be reset before reuse
+        void FillDataTree(SiPMEvent & l_event);
+        // Alignment mode: fills the aligned tree up to the entry of l_event, and up to the end of the DAQ run if l_event is NULL
+        void FillAligned(const SiPMEvent * l_event);
+        // Adds a branch (TTree) or a field (RNTuple) to the data tree, reading from address
+        template <class T> 
+        void BookField(const char * name, T * address);
+
         // The root output file
 
         TFile * m_outfile;
+        bool m_ownsOutput; // false if the file was given with AttachOutput
 
         // The metadata tree;
 
@@ -58,6 +128,12 @@ class SiPMDecoder
 
         TTree * m_datatree;
 
+        // The data tree if written as RNTuple (see SetOutputFormat), defined in SiPMDecoder.cxx
+
+        struct NTupleSink;
+        NTupleSink * m_ntuple; //!
+        unsigned int m_outputFormat;
+
         // The class representing the file input
 
         FileInfo m_finfo;
@@ -66,6 +142,37 @@ class SiPMDecoder
 
         SiPMEvent m_event;
 
+        // Compact copy of m_event written instead of the dense arrays, and its layout (an OutputLayout)
+
+        SiPMSparseEvent m_sparseEvent;
+        int m_outputLayout;
+
+        // Fused alignment to the DAQ events (disabled if m_alignEntries < 0): next aligned entry to be filled
+
+        SiPMAligner m_aligner;
+        Long64_t m_alignEntries;
+        long m_alignOffset;
+        Long64_t m_alignNext;
+
+        // Configuration of the streaming event building (disabled if m_streamWindow is 0)
+
+        unsigned int m_streamWindow;
+        unsigned int m_expectedBoards;
+
+        // Number of decoding threads
+
+        unsigned int m_nThreads;
+
+        // Whether the Timing and Counting files are decoded
+
+        bool m_enableTimingCounting;
+
+        // Output settings
+
+        int m_compressionAlgorithm;
+        int m_compressionLevel;
+        int m_basketSize;
+        Long64_t m_autoFlush;
         
 };
 
@@ -2,6 +2,7 @@
 #define SIPMDECODER_SIPMEVENT_H
 
 #include <array>
+#include <vector>
 #include <fstream>
 
 #include "hardcoded.h"
@@ -29,7 +30,7 @@ public:
   ~SiPMEvent();
   void Reset();
   //bool ReadEvent(FileInfo & l_fileinfo);
-  bool ReadEventFragment(const std::vector<char> & l_data, AcquisitionMode l_acqMode,int l_timeUnit,float l_conversion);
+  bool ReadEventFragment(const char * l_data, std::size_t l_size, const FragmentFormat & l_format);
   long m_triggerID;
   std::array<double,MAX_BOARDS> m_timeStamps; // the timestamp of each board
   void ComputeEventTimeStamp(); // compute m_evTimeStamp
@@ -42,6 +43,14 @@ public:
   std::array<uint16_t,MAX_BOARDS*NCHANNELS> m_LG;
   std::array<float,MAX_BOARDS*NCHANNELS> m_ToA;
   std::array<float,MAX_BOARDS*NCHANNELS> m_ToT;
+
+  // Timing and Counting modes. The channel index is boardID*NCHANNELS + channel, as for the arrays above, 
+  // but only the hits (or the channels in the mask) are stored
+  std::vector<uint16_t> m_hitChannel;
+  std::vector<float> m_hitToA;
+  std::vector<float> m_hitToT;
+  std::vector<uint16_t> m_countChannel;
+  std::vector<uint32_t> m_counts;
   
 private:
   SiPMEventFragment m_fragment; // used to temporary store the data of a fragment
@@ -7,6 +7,7 @@
 
 #include <array>
 #include <vector>
+#include <cstddef>
 
 /***************************************************
 ## \file SiPMEventFragment.h 
@@ -17,13 +18,33 @@
 ##
 ##***************************************************/
 
+class SiPMEventFragment;
+
+// File-level settings needed to decode the fragments. They are taken from the file header 
+// and from the first fragment of the file (see FileInfo::ReadHeader)
+
+struct FragmentFormat
+{
+    using Decoder = bool (SiPMEventFragment::*)(const char *, std::size_t, const FragmentFormat &);
+
+    AcquisitionMode acqMode = AcquisitionMode::kSpectroscopyTiming;
+    int timeUnit = 0;        // 0: ToA/ToT in LSB, 1: in ns
+    float conversion = 0.;   // ToA/ToT conversion from LSB to ns
+    int uniformChType = -1;  // channel type shared by all 64 channels in the first fragment, -1 if they differ
+    Decoder decoder = nullptr; // chosen once per file with SiPMEventFragment::SelectDecoder
+};
+
 class SiPMEventFragment
 {
     public:
         SiPMEventFragment();
         ~SiPMEventFragment(){};
-        bool Read(const std::vector<char> &, AcquisitionMode l_acqMode, int l_timeUnit,float l_conversion);
+        // Decodes the l_size bytes of a fragment starting at l_data (e.g. directly from the file mapping)
+        bool Read(const char * l_data, std::size_t l_size, const FragmentFormat & l_format);
         void Reset();
+        // Returns the decoder specialised for the acquisition mode, time unit and channel type of l_format. 
+        // The verbosity has to be set before, as the pedantic printout is only done by the generic decoder
+        static FragmentFormat::Decoder SelectDecoder(const FragmentFormat & l_format);
         uint16_t m_eventSize;
         uint8_t m_boardID;
         double m_timeStamp;
@@ -35,14 +56,33 @@ class SiPMEventFragment
         std::array<float,NCHANNELS> m_ToA;
         std::array<float,NCHANNELS> m_ToT;
 
+        // Timing mode: one entry per hit, in the order of the fragment (a channel can have several hits)
+        std::vector<uint8_t> m_hitChannel;
+        std::vector<float> m_hitToA;
+        std::vector<float> m_hitToT;
+
+        // Counting mode: one entry per channel in the channel mask
+        std::vector<uint8_t> m_countChannel;
+        std::vector<uint32_t> m_counts;
+
     private: 
 
-        // These are the functions actually used depending on the acquisition mode
+        // These are the functions actually used depending on the acquisition mode. 
+        // Spectroscopy is decoded as Spectroscopy & Timing, the only difference is in the payload
 
-        bool ReadSpectroscopy(const std::vector<char> &);
-        bool ReadSpectroscopyTiming(const std::vector<char> &,int l_timeUnit = -1,float l_conversion = -1.);
-        bool ReadTiming(const std::vector<char> &);
-        bool ReadCounting(const std::vector<char> &);
+        // Generic decoder: any channel type and order. TimeUnit tells how ToA and ToT are stored
+        template <int TimeUnit> 
+        bool ReadSpectroscopyTiming(const char *, std::size_t, const FragmentFormat &);
+        // Fast path for fragments where all 64 channels have type ChType, so that the payload has a 
+        // fixed stride. Falls back to the generic decoder if the fragment does not have this layout
+        template <uint8_t ChType, int TimeUnit> 
+        bool ReadUniformLayout(const char *, std::size_t, const FragmentFormat &);
+        template <int TimeUnit> 
+        static FragmentFormat::Decoder SelectUniformDecoder(int l_chType);
+        bool ReadTiming(const char *, std::size_t, const FragmentFormat &);
+        bool ReadCounting(const char *, std::size_t, const FragmentFormat &);
+        // Decodes the 27 bytes common to all fragments and moves p after them
+        void ReadHeader(const uint8_t* & p, uint64_t & channelMask);
 
 };
 
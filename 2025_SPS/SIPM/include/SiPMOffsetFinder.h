@@ -0,0 +1,96 @@
+#ifndef SIPMDECODER_SIPMOFFSETFINDER_H
+#define SIPMDECODER_SIPMOFFSETFINDER_H
+
+// stl includes
+
+#include <vector>
+#include <cstdint>
+
+// ROOT includes
+
+#include <TDirectory.h>
+#include <TTree.h>
+#include <Rtypes.h>
+
+/***************************************************
+## \file SiPMOffsetFinder.h
+## \brief: Finds the offset between the DAQ (PMT) entries and the SiPM trigger IDs.
+##      The SiPM boards do not fire on pedestal triggers, so for the right offset
+##      the DAQ pedestal entries i correspond to missing SiPM triggers i + offset.
+##      Each offset of a configurable range is scored by the number of pedestal
+##      entries for which the SiPM trigger is there (mismatches). The scan can
+##      also be done spill by spill, to follow offset changes within a run
+##
+##***************************************************/
+
+class SiPMOffsetFinder
+{
+public:
+  SiPMOffsetFinder(long minOffset = -4, long maxOffset = 4);
+  ~SiPMOffsetFinder(){};
+
+  void SetRange(long minOffset, long maxOffset);
+  void SetPedestalMask(Long64_t mask = 2) {m_pedestalMask = mask;} // TriggerMask of the pedestal events
+  // Length (in DAQ entries) of the segments of FindSegments if the DAQ tree has no EventSpill branch
+  void SetSegmentLength(Long64_t length = 1000) {m_segmentLength = length;}
+
+  // Inputs. Only the TriggerMask (and EventSpill) and TrigID branches are read
+  bool ReadDaqTree(TTree * daqTree);
+  bool ReadSiPMTree(TTree * sipmTree);
+  void SetSiPMTriggerIDs(const std::vector<long> & trigIDs); // e.g. from SiPMDecoder::GetTriggerIDs
+
+  // Scans the whole run and returns the offset with the fewest mismatches (the smallest one in case of ties)
+  long FindOffset();
+  // Best offset of each spill (or segment), starting from the one of FindOffset. Spills with less than
+  // minPedestals pedestals, or where the current offset is as good as any other, keep the current offset.
+  // Returns the number of segments with a constant offset
+  std::size_t FindSegments(unsigned int minPedestals = 5);
+
+  // Results
+  long GetOffset() const {return m_offset;}
+  const std::vector<long> & GetScanOffsets() const {return m_scanOffsets;}
+  const std::vector<Long64_t> & GetScanMismatches() const {return m_scanMismatches;}
+  const std::vector<Long64_t> & GetSegmentStarts() const {return m_segmentStarts;} // first DAQ entry of each segment
+  const std::vector<long> & GetSegmentOffsets() const {return m_segmentOffsets;}
+  Long64_t GetNDaqEntries() const {return m_nDaqEntries;}
+  std::size_t GetNPedestals() const {return m_pedestals.size();}
+  std::size_t GetNMissingSiPM() const {return m_nMissing;} // DAQ entries with no SiPM trigger (for offset 0)
+
+  // Writes the diagnostic histograms and graphs (as the former DR_makeRootFiles.DetermineOffset) to l_dir
+  void WriteDiagnostics(TDirectory * l_dir) const;
+
+private:
+  // Number of mismatches for the pedestals m_pedestals[first] ... m_pedestals[last - 1]
+  Long64_t CountMismatches(std::size_t first, std::size_t last, long offset) const;
+  // A pedestal at entry is a mismatch if the trigger entry + offset is outside the DAQ run or was recorded by the SiPM boards
+  bool IsMismatch(Long64_t entry, long offset) const 
+  {
+    const Long64_t l_trigID = entry + offset;
+    return l_trigID < 0 || l_trigID >= static_cast<Long64_t>(m_sipmPresent.size()) || m_sipmPresent[l_trigID];
+  }
+  // Builds m_sipmPresent from m_sipmTrigIDs
+  void FillSiPMPresent();
+
+  long m_minOffset;
+  long m_maxOffset;
+  Long64_t m_pedestalMask;
+  Long64_t m_segmentLength;
+
+  // DAQ side: number of entries, pedestal entries (sorted) and spill of each entry (empty if there is no EventSpill branch)
+  Long64_t m_nDaqEntries;
+  std::vector<Long64_t> m_pedestals;
+  std::vector<Int_t> m_spill;
+
+  // SiPM side: the trigger IDs, and m_sipmPresent[t] = 1 if the trigger t (0 <= t < number of DAQ entries) is there
+  std::vector<long> m_sipmTrigIDs;
+  std::vector<uint8_t> m_sipmPresent;
+  std::size_t m_nMissing;
+
+  long m_offset;
+  std::vector<long> m_scanOffsets;
+  std::vector<Long64_t> m_scanMismatches;
+  std::vector<Long64_t> m_segmentStarts;
+  std::vector<long> m_segmentOffsets;
+};
+
+#endif // #ifndef SIPMDECODER_SIPMOFFSETFINDER_H
@@ -0,0 +1,85 @@
+#ifndef SIPMDECODER_SIPMSPARSEEVENT_H
+#define SIPMDECODER_SIPMSPARSEEVENT_H
+
+#include "hardcoded.h"
+#include "SiPMEvent.h"
+
+#include <array>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+/***************************************************
+## \file SiPMSparseEvent.h 
+## \brief: Compact version of SiPMEvent for the output tree. Only the boards 
+##      present in the trigger are stored (OutputLayout::kBoards), or only the 
+##      channels above a threshold (OutputLayout::kZeroSuppressed). The static 
+##      helpers rebuild the dense 1024-channel view when reading the tree back
+##
+##***************************************************/
+
+class SiPMSparseEvent
+{
+public:
+  SiPMSparseEvent();
+  ~SiPMSparseEvent(){};
+
+  // HG threshold of each channel (index boardID*NCHANNELS + channel) for kZeroSuppressed. 
+  // A channel is kept if its HG is above the threshold. Returns false if the size is not MAX_BOARDS*NCHANNELS
+  bool SetThresholds(const std::vector<float> & thresholds);
+
+  // Compacts l_event according to l_layout (kDense leaves this object empty)
+  void Fill(const SiPMEvent & l_event, OutputLayout l_layout);
+
+  // Boards present in the trigger, in increasing order
+  std::vector<uint8_t> m_boards;
+  // kZeroSuppressed only: channels kept (boardID*NCHANNELS + channel), in increasing order
+  std::vector<uint16_t> m_channels;
+  // kBoards: NCHANNELS values for each board in m_boards. kZeroSuppressed: one value for each entry of m_channels
+  std::vector<uint16_t> m_HG;
+  std::vector<uint16_t> m_LG;
+  std::vector<float> m_ToA;
+  std::vector<float> m_ToT;
+
+  // Reader helpers: rebuild the dense view (MAX_BOARDS*NCHANNELS values, 0 for what is not stored)
+
+  template <class T>
+  static void BoardsToDense(const std::vector<uint8_t> & boards, const std::vector<T> & blocks, std::vector<T> & dense)
+  {
+    dense.resize(MAX_BOARDS * NCHANNELS);
+    BoardsToDense(boards, blocks, dense.data());
+  }
+
+  template <class T>
+  static void ChannelsToDense(const std::vector<uint16_t> & channels, const std::vector<T> & values, std::vector<T> & dense)
+  {
+    dense.resize(MAX_BOARDS * NCHANNELS);
+    ChannelsToDense(channels, values, dense.data());
+  }
+
+  // Same as above, writing into an existing array of MAX_BOARDS*NCHANNELS values (e.g. the arrays of SiPMEvent)
+
+  template <class T>
+  static void BoardsToDense(const std::vector<uint8_t> & boards, const std::vector<T> & blocks, T * dense)
+  {
+    std::fill_n(dense, MAX_BOARDS * NCHANNELS, T(0));
+    for (std::size_t i = 0; i < boards.size() && (i + 1) * NCHANNELS <= blocks.size(); ++i){
+      if (boards[i] >= MAX_BOARDS) continue;
+      std::copy_n(blocks.begin() + i * NCHANNELS, NCHANNELS, dense + boards[i] * NCHANNELS);
+    }
+  }
+
+  template <class T>
+  static void ChannelsToDense(const std::vector<uint16_t> & channels, const std::vector<T> & values, T * dense)
+  {
+    std::fill_n(dense, MAX_BOARDS * NCHANNELS, T(0));
+    for (std::size_t i = 0; i < channels.size() && i < values.size(); ++i){
+      if (channels[i] < MAX_BOARDS * NCHANNELS) dense[channels[i]] = values[i];
+    }
+  }
+
+private:
+  std::array<float,MAX_BOARDS*NCHANNELS> m_thresholds;
+};
+
+#endif // #ifndef SIPMDECODER_SIPMSPARSEEVENT_H
@@ -17,12 +17,20 @@ enum class Verbose { kQuiet, kError, kWarn, kInfo, kPedantic };
 // Enum for different acquisition modes
 enum class AcquisitionMode { kSpectroscopy = 1, kTiming, kSpectroscopyTiming, kCounting };
 
+// Layout of the SiPM data in the output tree (Spectroscopy modes): full 1024-channel arrays, 
+// only the boards present in the trigger, or only the channels above threshold
+enum class OutputLayout { kDense = 0, kBoards, kZeroSuppressed };
+
 // Maximum number of boards (in this case 5 boards used at test beam)
 static constexpr uint8_t MAX_BOARDS = 16;
 // Number of channels read out by each board
 static constexpr uint8_t NCHANNELS = 64;
 // Size on the file header (14 bytes as per CAEN manual)
 static constexpr uint32_t FILE_HEADER_SIZE = 25;
+// Size of the header of an event fragment (size, boardID, timestamp, trigID, channel mask)
+static constexpr uint32_t FRAGMENT_HEADER_SIZE = 27;
+// Timing mode fragments have no trigger ID and no channel mask: size (2), boardID (1), timestamp (8), number of hits (2)
+static constexpr uint32_t TIMING_HEADER_SIZE = 13;
 
 
 // Bit flags
@@ -2,7 +2,7 @@
 #define MAPPING_SIPM_HPP
 
 #include <array>
-#include <cmath>
+#include <cstddef>
 #include <string>
 
 namespace SiPMCaloMapping {
@@ -46,6 +46,8 @@ constexpr double HCELL = 28.3;   // height of a module in mm
 constexpr double WIDTH_CHANNEL = FIBER_DIAMETER * NFIBERS_PER_CHANNEL;  // width of a channel
 constexpr double HEIGHT_CHANNEL = FIBER_DIAMETER;                       // height of a channel
 
+constexpr double SQRT3 = 1.7320508075688772;  // std::sqrt(3.0), which is not constexpr
+
 /// Hardware location of the channel
 struct HWLoc {
     unsigned int boardID;  ///< boardID (0-15)
@@ -85,13 +87,14 @@ struct PhysInfo : public PhysLoc {
     return {idx / NCHANNELS_FERS, idx % NCHANNELS_FERS};
 }
 
-[[nodiscard]] inline unsigned int getFersIdFromBoardID(unsigned int boardID) noexcept {
-    constexpr std::array<unsigned int, NFERS> boardID_to_fersID = {2, 1, 4, 3, 6, 5, 8, 7, 10, 9, 15, 16, 13, 14, 11, 12};
+inline constexpr std::array<unsigned int, NFERS> boardID_to_fersID = {2, 1, 4, 3, 6, 5, 8, 7, 10, 9, 15, 16, 13, 14, 11, 12};
+inline constexpr std::array<unsigned int, NFERS> fersID_to_boardID = {1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 14, 15, 12, 13, 10, 11};
+
+[[nodiscard]] constexpr unsigned int getFersIdFromBoardID(unsigned int boardID) noexcept {
     return boardID_to_fersID[boardID];
 }
 
-[[nodiscard]] inline unsigned int getBoardIDFromFersId(unsigned int fersID) noexcept {
-    constexpr std::array<unsigned int, NFERS> fersID_to_boardID = {1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 14, 15, 12, 13, 10, 11};
+[[nodiscard]] constexpr unsigned int getBoardIDFromFersId(unsigned int fersID) noexcept {
     return fersID_to_boardID[fersID - 1];
 }
 
@@ -112,7 +115,9 @@ inline constexpr std::array<std::array<unsigned int, 4>, NFERS> columnOrder = {
     nominal_columnOrder, nominal_columnOrder                  // 313
 };
 
-[[nodiscard]] inline PhysLoc getPhysLocFromIdx(idx_t idx) {
+namespace details {
+
+[[nodiscard]] constexpr PhysLoc computePhysLoc(idx_t idx) noexcept {
     const HWLoc hw = getHWLocFromIdx(idx);
     const auto fersId = getFersIdFromBoardID(hw.boardID);
 
@@ -131,9 +136,55 @@ inline constexpr std::array<std::array<unsigned int, 4>, NFERS> columnOrder = {
     return PhysLoc{icol, irow, id_module};
 }
 
-/// Get physical information from index
-[[nodiscard]] inline PhysInfo getPhysInfoFromIdx(idx_t idx) {
-    const PhysLoc phys = getPhysLocFromIdx(idx);
+}  // namespace details
+
+/// Geometry of one channel, as returned by getPhysInfoFromIdx
+struct ChannelGeometry {
+    PhysLoc loc;
+    char type;                        ///< 'S' or 'C'
+    unsigned int fersId;              ///< fersId (1-16)
+    double x;                         ///< x position
+    double y;                         ///< y position
+    double x_local;                   ///< x position in the module
+    double y_local;                   ///< y position in the module
+    std::array<char, 4> module_name;  ///< module name (3xx), nul terminated
+};
+
+/// The same geometry as structure of arrays, for passes over all the channels of an event (clustering,
+/// centroids, lateral profiles) that the compiler can vectorise, and the neighbourhood of each channel.
+/// Rows are counted in the whole detector: row = (id_module - 1) * CHANNEL_NROWS_MODULE + row in the module,
+/// so that S channels are on even rows and C channels on odd rows
+struct GeometryTables {
+    static constexpr unsigned int MAX_NEIGHBOURS = 8;
+    static constexpr idx_t NO_CHANNEL = NCHANNELS;  ///< padding of neighbours
+
+    alignas(64) std::array<float, NCHANNELS> x;                ///< x position, by index
+    alignas(64) std::array<float, NCHANNELS> y;                ///< y position, by index
+    alignas(64) std::array<unsigned char, NCHANNELS> module;   ///< module id (1-8), by index
+    alignas(64) std::array<unsigned char, NCHANNELS> row;      ///< row in the detector (0-127), by index
+    alignas(64) std::array<unsigned char, NCHANNELS> column;   ///< column (0-7), by index
+    alignas(64) std::array<char, NCHANNELS> type;              ///< 'S' or 'C', by index
+
+    std::array<std::array<idx_t, CHANNEL_NCOLUMNS>, CHANNEL_NROWS> grid;  ///< index of the channel at [row][column]
+
+    /// Nearest channels of the same type: the next rows of that type (row +-2) in the same and in the
+    /// adjacent columns, across module boundaries. The first nNeighbours[idx] entries are valid
+    std::array<std::array<idx_t, MAX_NEIGHBOURS>, NCHANNELS> neighbours;
+    std::array<unsigned char, NCHANNELS> nNeighbours;
+};
+
+/// One mapping configuration, from first_run up to the first run of the next one. All its tables are
+/// computed at compile time
+struct Configuration {
+    unsigned int first_run;
+    std::array<ChannelGeometry, NCHANNELS> geometry;  ///< by index
+    GeometryTables tables;
+};
+
+namespace details {
+
+[[nodiscard]] constexpr ChannelGeometry computeGeometry(idx_t idx) noexcept {
+    const PhysLoc phys = computePhysLoc(idx);
     const HWLoc hw = getHWLocFromIdx(idx);
     const auto fersId = getFersIdFromBoardID(hw.boardID);
 
@@ -145,18 +196,114 @@ inline constexpr std::array<std::array<unsigned int, 4>, NFERS> columnOrder = {
 
     const char type_fiber = (irow % 2 == 0) ? 'S' : 'C';
 
-    const double y_module = (irow - (CHANNEL_NROWS_MODULE - 1) / 2.0) * FIBER_DIAMETER * std::sqrt(3.0) / 2.0;
+    const double y_module = (irow - (CHANNEL_NROWS_MODULE - 1) / 2.0) * FIBER_DIAMETER * SQRT3 / 2.0;
     const double x_module = (icol * NFIBERS_PER_CHANNEL + (NFIBERS_PER_CHANNEL - 1) / 2.0 - (CHANNEL_NCOLUMNS * NFIBERS_PER_CHANNEL - 1) / 2.0) * FIBER_DIAMETER + x_offset;
 
     const double x = x_module;
     const double y = y_module + HCELL * (id_module - 1) - HCELL * 3.5;
 
-    const unsigned int modnum = id_module + 5;
-    std::string module_name = "3";
-    if (modnum < 10) module_name += "0";
-    module_name += std::to_string(modnum);
+    const unsigned int modnum = id_module + 5;  // "3" + two digits
+    const std::array<char, 4> module_name = {'3', char('0' + modnum / 10), char('0' + modnum % 10), '\0'};
+
+    return ChannelGeometry{phys, type_fiber, fersId, x, y, x_module, y_module, module_name};
+}
+
+constexpr GeometryTables make_tables(const std::array<ChannelGeometry, NCHANNELS>& geometry) {
+    GeometryTables tables{};
+    for (auto& grid_row : tables.grid) {
+        for (auto& cell : grid_row) cell = GeometryTables::NO_CHANNEL;
+    }
+    for (idx_t idx = 0; idx < NCHANNELS; ++idx) {
+        const ChannelGeometry& channel = geometry[idx];
+        const unsigned int row = (channel.loc.id_module - 1) * CHANNEL_NROWS_MODULE + channel.loc.row;
+        tables.x[idx] = static_cast<float>(channel.x);
+        tables.y[idx] = static_cast<float>(channel.y);
+        tables.module[idx] = static_cast<unsigned char>(channel.loc.id_module);
+        tables.row[idx] = static_cast<unsigned char>(row);
+        tables.column[idx] = static_cast<unsigned char>(channel.loc.column);
+        tables.type[idx] = channel.type;
+        tables.grid[row][channel.loc.column] = idx;
+    }
+    for (idx_t idx = 0; idx < NCHANNELS; ++idx) {
+        unsigned int n = 0;
+        for (int drow = -2; drow <= 2; drow += 2) {
+            for (int dcolumn = -1; dcolumn <= 1; ++dcolumn) {
+                const int row = tables.row[idx] + drow;
+                const int column = tables.column[idx] + dcolumn;
+                if ((drow == 0 and dcolumn == 0) or row < 0 or row >= int(CHANNEL_NROWS) or column < 0 or column >= int(CHANNEL_NCOLUMNS)) continue;
+                tables.neighbours[idx][n++] = tables.grid[row][column];
+            }
+        }
+        tables.nNeighbours[idx] = static_cast<unsigned char>(n);
+        for (; n < GeometryTables::MAX_NEIGHBOURS; ++n) tables.neighbours[idx][n] = GeometryTables::NO_CHANNEL;
+    }
+    return tables;
+}
+
+constexpr Configuration make_configuration(unsigned int first_run) {
+    Configuration configuration{first_run, {}, {}};
+    for (idx_t idx = 0; idx < NCHANNELS; ++idx) {
+        configuration.geometry[idx] = computeGeometry(idx);
+    }
+    configuration.tables = make_tables(configuration.geometry);
+    return configuration;
+}
+
+/// Every cell of the grid is a channel, and every channel is in a single cell
+constexpr bool is_grid_complete(const GeometryTables& tables) {
+    for (unsigned int row = 0; row < CHANNEL_NROWS; ++row) {
+        for (unsigned int column = 0; column < CHANNEL_NCOLUMNS; ++column) {
+            const idx_t idx = tables.grid[row][column];
+            if (idx >= NCHANNELS or tables.row[idx] != row or tables.column[idx] != column) return false;
+        }
+    }
+    return true;
+}
+
+/// Registry of the configurations, sorted by first run. A new mapping is one more line here
+inline constexpr std::array<Configuration, 1> configurations = {{
+    make_configuration(0)
+}};
+
+static_assert(configurations[0].first_run == 0, "The first configuration must start from run 0");
+static_assert(is_grid_complete(configurations[0].tables), "The channels do not fill the row/column grid");
+
+}  // namespace details
+
+[[nodiscard]] constexpr std::size_t getConfigurationIndex(unsigned int run) noexcept {
+    std::size_t i = details::configurations.size() - 1;
+    while (i > 0 && run < details::configurations[i].first_run) --i;
+    return i;
+}
+
+[[nodiscard]] constexpr const Configuration& getConfiguration(unsigned int run) noexcept {
+    return details::configurations[getConfigurationIndex(run)];
+}
 
-    return PhysInfo{icol, irow, id_module, type_fiber, fersId, x, y, x_module, y_module, module_name};
+/// Geometry of a channel: a single table load. Without a run, the first configuration
+[[nodiscard]] constexpr const ChannelGeometry& getChannelGeometry(idx_t idx, unsigned int run = 0) noexcept {
+    return getConfiguration(run).geometry[idx];
+}
+
+/// Structure-of-arrays geometry, grid and neighbourhood. Without a run, the first configuration
+[[nodiscard]] constexpr const GeometryTables& getGeometryTables(unsigned int run = 0) noexcept {
+    return getConfiguration(run).tables;
+}
+
+/// Index of the channel at (row in the detector, column)
+[[nodiscard]] constexpr idx_t getIdxFromGrid(unsigned int row, unsigned int column, unsigned int run = 0) noexcept {
+    return getGeometryTables(run).grid[row][column];
+}
+
+[[nodiscard]] constexpr PhysLoc getPhysLocFromIdx(idx_t idx) noexcept {
+    return getChannelGeometry(idx).loc;
+}
+
+/// Get physical information from index
+[[nodiscard]] inline PhysInfo getPhysInfoFromIdx(idx_t idx) {
+    const ChannelGeometry& geometry = getChannelGeometry(idx);
+    return PhysInfo{geometry.loc.column, geometry.loc.row, geometry.loc.id_module, geometry.type, geometry.fersId,
+                    geometry.x, geometry.y, geometry.x_local, geometry.y_local, geometry.module_name.data()};
 }
 
 /// Get index from hardware location
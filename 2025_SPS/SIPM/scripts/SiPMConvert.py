@@ -20,6 +20,17 @@ bad_processing = []
 skipRun = []
 
 verbosityLevel = 3
+useMemoryMap = True
+streamWindow = 0
+expectedBoards = 0
+nThreads = 1
+nFiles = 1
+useRNTuple = False
+outputLayout = 0
+zsPedestals = ''
+zsNSigma = 3.
+enableTimingCounting = False
+outputSettings = {'compressionAlgorithm' : -1, 'compressionLevel' : -1, 'basketSize' : 0, 'autoFlush' : 0, 'imt' : -1}
    
 def getRunNumber(fname):
     runNumber = os.path.basename(fname).split('_')[0].split('.')[0].lstrip('Run')
@@ -53,20 +64,55 @@ def getFiles(forceAll):
                     files.append(filename)
     return files
 
-def runConversion(ifname,ofname,doEventBuilding=True):
-    print('\n\n')
+def setZeroSuppression(myDecoder):
+    # Pedestal file as in MapAndCalibration/SiPM_pedestals_v1.json: {"index" : {"median_HG" : ..., "iqr_eff_HG" : ...}}
+    import json
+    with open(zsPedestals) as f:
+        pedestals = json.load(f)
+    pedestal = ROOT.std.vector('float')(1024, 0.)
+    sigma = ROOT.std.vector('float')(1024, 0.)
+    for index, values in pedestals.items():
+        pedestal[int(index)] = values['median_HG']
+        sigma[int(index)] = values['iqr_eff_HG']
+    return myDecoder.SetZeroSuppression(pedestal,sigma,zsNSigma)
+
+def makeDecoder(ifname):
+    # Creates a SiPMDecoder with the settings of this module and connects it to ifname. Returns None if something goes wrong
     global bad_processing
-    checkProcess = True
     myDecoder = ROOT.SiPMDecoder()
     global verbosityLevel
     myDecoder.SetVerbosity(verbosityLevel)
    
-    checkProcess = myDecoder.ConnectFile(ifname)
+    myDecoder.SetStreamingEventBuilding(streamWindow,expectedBoards)
+    myDecoder.SetNThreads(nThreads)
+    myDecoder.SetCompression(outputSettings['compressionAlgorithm'],outputSettings['compressionLevel'])
+    myDecoder.SetBasketSize(outputSettings['basketSize'])
+    myDecoder.SetAutoFlush(outputSettings['autoFlush'])
+    if outputSettings['imt'] >= 0:
+        myDecoder.SetImplicitMT(outputSettings['imt'])
+    myDecoder.SetOutputLayout(outputLayout)
+    myDecoder.EnableTimingCountingModes(enableTimingCounting)
+    if useRNTuple and not myDecoder.SetOutputFormat(1):
+        bad_processing.append(ifname)
+        return None
+    if zsPedestals != '':
+        if not setZeroSuppression(myDecoder):
+            bad_processing.append(ifname)
+            return None
+    checkProcess = myDecoder.ConnectFile(ifname,useMemoryMap)
 
     if not checkProcess:
         print("SiPMDecoder::ConnectFile() ERROR! Cannot open file " + ifname)
         bad_processing.append(ifname)
-        return 
+        return None
+    return myDecoder
+
+def runConversion(ifname,ofname,doEventBuilding=True):
+    print('\n\n')
+    global bad_processing
+    myDecoder = makeDecoder(ifname)
+    if myDecoder is None:
+        return
     
     checkProcess = myDecoder.OpenOutput(ofname)
     
@@ -91,15 +137,28 @@ def runConversion(ifname,ofname,doEventBuilding=True):
     
 
 
+def convertOne(filename,doEventBuilding = True):
+    tempOutFileName = "temp_output_" + getRunNumber(filename) + ".root"
+    print ("\n\nA temporary output file with name " + tempOutFileName + " will be opened and then renamed at the end of the processing.")
+    runConversion(filename, tempOutFileName, doEventBuilding)
+    shutil.move(tempOutFileName,correspondingOutputName(filename))
+
 def convertAll(fnames,doEventBuilding = True):
     global skipRun
-    for filename in fnames:
-        if getRunNumber(filename) in  skipRun:
-            continue
-        tempOutFileName = "temp_output_" + getRunNumber(filename) + ".root"
-        print ("\n\nA temporary output file with name " + tempOutFileName + " will be opened and then renamed at the end of the processing.")
-        runConversion(filename, tempOutFileName, doEventBuilding)
-        shutil.move(tempOutFileName,correspondingOutputName(filename))
+    fnames = [f for f in fnames if getRunNumber(f) not in skipRun]
+    if nFiles <= 1:
+        for filename in fnames:
+            convertOne(filename,doEventBuilding)
+        return
+
+    # Several runs converted at the same time in this process, one decoder per thread. 
+    # The GIL is released while a decoder reads its file, so the conversions really run in parallel
+    from concurrent.futures import ThreadPoolExecutor
+    ROOT.SiPMDecoder.EnableThreadSafety()
+    ROOT.SiPMDecoder.Read.__release_gil__ = True
+    with ThreadPoolExecutor(max_workers=nFiles) as executor:
+        for result in executor.map(lambda f : convertOne(f,doEventBuilding), fnames):
+            pass
 
 
 def main():
@@ -110,6 +169,21 @@ def main():
     parser.add_argument('-V', '--verbosityLevel', dest='verbosityLevel', default=3, help="Controls the verbosity level - Remember:  0=Quiet, 1=Error, 2=Warn, 3=Info, 4=Pedantic" )
     parser.add_argument('--forceAll', action='store_true',help='Forces reprocessing all files.')
     parser.add_argument('--noEventBuilding',action="store_true",help="Disables event building: one entry will correspond to one board")
+    parser.add_argument('--noMemoryMap',action="store_true",help="Reads the input file through a stream instead of memory-mapping it")
+    parser.add_argument('--streamWindow',dest='streamWindow',default=0,type=int,help="If larger than 0, builds events while reading the file sequentially, keeping at most this number of triggers open, instead of indexing the whole file first")
+    parser.add_argument('-j', '--nThreads',dest='nThreads',default=1,type=int,help="Number of threads used to decode the events (index-based event building with a memory-mapped input file only)")
+    parser.add_argument('--compressionAlgorithm',dest='compressionAlgorithm',default=-1,type=int,help="Compression algorithm of the output file (1 = zlib, 2 = lzma, 4 = lz4, 5 = zstd). Negative: ROOT default")
+    parser.add_argument('--compressionLevel',dest='compressionLevel',default=-1,type=int,help="Compression level of the output file. Negative: ROOT default")
+    parser.add_argument('--basketSize',dest='basketSize',default=0,type=int,help="Basket size in bytes for the branches of the SiPM tree. 0: ROOT default")
+    parser.add_argument('--autoFlush',dest='autoFlush',default=0,type=int,help="Auto-flush setting of the SiPM tree (entries if positive, bytes if negative). 0: ROOT default")
+    parser.add_argument('--imt',dest='imt',default=-1,type=int,help="If not negative, enables ROOT implicit multithreading with this number of threads (0: all cores) to compress the output in parallel")
+    parser.add_argument('--outputLayout',dest='outputLayout',default=0,type=int,choices=[0,1,2],help="Layout of the SiPM data in the output: 0 = dense 1024-channel arrays, 1 = only the boards present in each trigger, 2 = only the channels above threshold (see --zsPedestals)")
+    parser.add_argument('--zsPedestals',dest='zsPedestals',default='',help="Pedestal json file (as MapAndCalibration/SiPM_pedestals_v1.json). If given, only channels with HG above pedestal + zsNSigma * sigma are written (implies --outputLayout 2)")
+    parser.add_argument('--zsNSigma',dest='zsNSigma',default=3.,type=float,help="Zero suppression threshold in units of the pedestal width")
+    parser.add_argument('--rntuple',action="store_true",help="Writes SiPM_rawTree as an RNTuple instead of a TTree (use --imt to compress the pages in parallel)")
+    parser.add_argument('--nFiles',dest='nFiles',default=1,type=int,help="Number of runs converted at the same time, each by its own decoder in a separate thread of this process")
+    parser.add_argument('--enableTimingCounting',action="store_true",help="Converts the files in Timing or Counting mode. Their decoding has not been validated on real Janus files yet")
+    parser.add_argument('--expectedBoards',dest='expectedBoards',default=0,type=int,help="With --streamWindow, number of boards after which a trigger is considered complete and written out (0: triggers are only written out when they leave the window)")
     par  = parser.parse_args()
     global rawdataPath 
     rawdataPath = par.rawdataPath
@@ -119,6 +193,29 @@ def main():
     verbosityLevel = int(par.verbosityLevel)
 
     doEventBuilding = not par.noEventBuilding
+    global useMemoryMap
+    useMemoryMap = not par.noMemoryMap
+    global streamWindow
+    streamWindow = par.streamWindow
+    global expectedBoards
+    expectedBoards = par.expectedBoards
+    global nThreads
+    nThreads = par.nThreads
+    global nFiles
+    nFiles = par.nFiles
+    global useRNTuple
+    useRNTuple = par.rntuple
+    global outputLayout, zsPedestals, zsNSigma
+    outputLayout = par.outputLayout
+    zsPedestals = par.zsPedestals
+    zsNSigma = par.zsNSigma
+    global enableTimingCounting
+    enableTimingCounting = par.enableTimingCounting
+    if outputLayout == 2 and zsPedestals == '':
+        print("ERROR: --outputLayout 2 needs the pedestals for the zero suppression (--zsPedestals)")
+        exit()
+    for key in outputSettings:
+        outputSettings[key] = getattr(par,key)
     
     if os.path.isfile(rawdataPath):
         print("Processing a single file named " + rawdataPath)
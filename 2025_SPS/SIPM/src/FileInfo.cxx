@@ -12,9 +12,21 @@
 #include <iomanip>
 #include <iostream>
 #include <array>
+#include <algorithm>
 
 #include <sstream>
 
+// POSIX includes for the memory-mapped backend
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The stream backend reads the file in chunks of this size, so that sequential decoding
+// results in large sequential reads rather than one small read per fragment
+static constexpr std::size_t STREAM_READAHEAD = 1 << 20;
+
 FileInfo::FileInfo():
     m_dataFormat(""),
     m_software(""),
@@ -25,38 +37,108 @@ FileInfo::FileInfo():
     m_timeUnit(0),
     m_ToAToT_conv(0),
     m_acqTime(0),
-    m_inputfile(NULL),
     m_filename(""),
-    m_filesize(0)
+    m_filesize(0),
+    m_map(nullptr),
+    m_cursor(0),
+    m_bufferStart(0)
     {}
 
-bool FileInfo::OpenFile(std::string filename)
+FileInfo::~FileInfo()
 {
-    m_filename = filename;
-    if (m_inputfile.is_open()){
+    if (m_map){
+        munmap(const_cast<char *>(m_map), m_filesize);
+    }
+}
+
+bool FileInfo::OpenFile(std::string filename, bool useMemoryMap)
+{
+    if (m_map || m_inputfile.is_open()){
         logging("Error in Decoder::ConnectFile - a file is already connected", Verbose::kError);
         return false;
     }
-
-    std::ifstream inputStream(m_filename, std::ios::binary | std::ios::ate);
+    m_filename = filename;
     logging("Opening file: " + m_filename, Verbose::kInfo);
 
-    if (!inputStream) {
+    int fd = open(m_filename.c_str(), O_RDONLY);
+    if (fd < 0) {
         logging("Cannot open file: " + m_filename, Verbose::kError);
         return false;
     }
 
-    m_filesize = static_cast<uint64_t>(inputStream.tellg());
-    std::cout << "FileSize " << m_filesize << std::endl;
-    inputStream.close();
-    if (inputStream.is_open()) {
-        logging("Cannot close file file: " + m_filename, Verbose::kError);
+    struct stat l_stat;
+    if (fstat(fd, &l_stat) != 0) {
+        logging("Cannot determine the size of file: " + m_filename, Verbose::kError);
+        close(fd);
         return false;
-    } 
+    }
+    m_filesize = static_cast<uint64_t>(l_stat.st_size);
+    m_cursor = 0;
 
     logging("File size: " + std::to_string(static_cast<double>(m_filesize) / (1024 * 1024)) + " MiB", Verbose::kInfo);
+
+    if (m_filesize < FILE_HEADER_SIZE) {
+        logging("File " + m_filename + " is too small to contain a file header", Verbose::kError);
+        close(fd);
+        return false;
+    }
+
+    if (useMemoryMap){
+        // Map the whole file read-only. The fragments are then decoded directly from the mapping
+        void * l_map = mmap(nullptr, m_filesize, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (l_map != MAP_FAILED){
+            m_map = static_cast<const char *>(l_map);
+            close(fd); // the mapping stays valid after closing the descriptor
+            logging("File memory-mapped", Verbose::kInfo);
+            return true;
+        }
+        logging("Cannot memory-map " + m_filename + ", falling back to stream reading", Verbose::kWarn);
+    }
+    close(fd);
+
     m_inputfile.open(m_filename, std::ios::binary);
+    if (!m_inputfile) {
+        logging("Cannot open file: " + m_filename, Verbose::kError);
+        return false;
+    }
+
+    return true;
+}
+
+bool FileInfo::PeekBytes(uint64_t offset, void * dst, std::size_t n)
+{
+    if (offset + n > m_filesize) return false;
+    if (m_map){
+        std::memcpy(dst, m_map + offset, n);
+        return true;
+    }
+    if (!FillBuffer(offset, n)) return false;
+    std::memcpy(dst, m_buffer.data() + (offset - m_bufferStart), n);
+    return true;
+}
 
+const char * FileInfo::FragmentAt(uint64_t offset, uint16_t size)
+{
+    if (offset + size > m_filesize) return nullptr;
+    if (m_map) return m_map + offset;
+    if (!FillBuffer(offset, size)) return nullptr;
+    return m_buffer.data() + (offset - m_bufferStart);
+}
+
+bool FileInfo::FillBuffer(uint64_t offset, std::size_t n)
+{
+    if (offset >= m_bufferStart && offset + n <= m_bufferStart + m_buffer.size()) return true; // already there
+
+    const std::size_t l_length = static_cast<std::size_t>(std::min<uint64_t>(std::max(n, STREAM_READAHEAD), m_filesize - offset));
+    m_buffer.resize(l_length);
+    m_inputfile.clear();
+    m_inputfile.seekg(static_cast<std::streamoff>(offset), std::ios::beg);
+    m_inputfile.read(m_buffer.data(), l_length);
+    if (!m_inputfile.good()){
+        m_buffer.clear();
+        return false;
+    }
+    m_bufferStart = offset;
     return true;
 }
 
@@ -67,7 +149,11 @@ bool FileInfo::ReadHeader()
 
     // Reading the header into an array of chars, then filling the class FileHeader with its contents
 
-    m_inputfile.read(l_header.data(),FILE_HEADER_SIZE);
+    if (!PeekBytes(0, l_header.data(), FILE_HEADER_SIZE)){
+        logging("Cannot read the file header", Verbose::kError);
+        return false;
+    }
+    m_cursor = FILE_HEADER_SIZE;
 
     logging("Now printing the raw hex content of the header\n",Verbose::kPedantic);
 
@@ -151,58 +237,135 @@ bool FileInfo::ReadHeader()
 
     std::memcpy(&m_acqTime, &l_header[17], 8);
     std::time_t tt = m_acqTime/1000;   // Unix seconds
-    std::tm tm = *std::gmtime(&tt);                // or std::gmtime for UTC
+    std::tm tm{};
+    gmtime_r(&tt, &tm);                // UTC. gmtime_r as several files may be opened in parallel
     std::ostringstream oss;
     oss << std::put_time(&tm, "%Y-%m-%d %H:%M:%S") << '.' << std::setw(3) << std::setfill('0') << (m_acqTime % 1000);
     std::string ts = oss.str();  
     logging("Run Start Time: " + ts, Verbose::kInfo);
 
+    m_format.acqMode = static_cast<AcquisitionMode>(m_acqMode);
+    m_format.timeUnit = m_timeUnit;
+    m_format.conversion = m_ToAToT_conv;
+    DetectUniformLayout();
+    m_format.decoder = SiPMEventFragment::SelectDecoder(m_format);
+    if (!m_format.decoder) return false;
+
     return true;
 }
 
+void FileInfo::DetectUniformLayout()
+{
+    m_format.uniformChType = -1;
+    if (m_format.acqMode != AcquisitionMode::kSpectroscopy && m_format.acqMode != AcquisitionMode::kSpectroscopyTiming) return;
+
+    const uint16_t eventSize = GetEventSize();
+    const char * l_data = FragmentAt(m_cursor, eventSize);
+    if (!l_data || eventSize < FRAGMENT_HEADER_SIZE + 2) return;
+
+    const uint8_t * p = reinterpret_cast<const uint8_t *>(l_data) + FRAGMENT_HEADER_SIZE;
+    const uint8_t l_chType = p[1];
+    const std::size_t l_stride = 2 + channelPayloadSize(l_chType, m_timeUnit);
+    if (eventSize != FRAGMENT_HEADER_SIZE + NCHANNELS * l_stride) return;
+
+    for (unsigned int ch = 0; ch < NCHANNELS; ++ch){
+        if (p[ch * l_stride] != ch || p[ch * l_stride + 1] != l_chType) return;
+    }
+
+    m_format.uniformChType = l_chType;
+    logging("All channels have type " + std::to_string(l_chType) + " in the first fragment", Verbose::kInfo);
+}
+
+void TrigIndex::Clear()
+{
+    m_fragments.clear();
+    m_trigIDs.clear();
+    m_first.clear();
+}
+
+void TrigIndex::Finalize()
+{
+    // Janus writes the fragments mostly in trigger order, so the sort is usually skipped.
+    // stable_sort keeps the fragments of a given trigger in file order
+    auto byTrigID = [](const FragmentRecord & a, const FragmentRecord & b){return a.trigID < b.trigID;};
+    if (!std::is_sorted(m_fragments.begin(), m_fragments.end(), byTrigID)){
+        std::stable_sort(m_fragments.begin(), m_fragments.end(), byTrigID);
+    }
+
+    m_trigIDs.clear();
+    m_first.clear();
+    for (std::size_t i = 0; i < m_fragments.size(); ++i){
+        if (i == 0 || m_fragments[i].trigID != m_fragments[i-1].trigID){
+            m_trigIDs.push_back(m_fragments[i].trigID);
+            m_first.push_back(i);
+        }
+    }
+    m_first.push_back(m_fragments.size());
+}
+
+long TrigIndex::Find(long trigID) const
+{
+    auto it = std::lower_bound(m_trigIDs.begin(), m_trigIDs.end(), trigID);
+    if (it == m_trigIDs.end() || *it != trigID) return -1;
+    return static_cast<long>(it - m_trigIDs.begin());
+}
+
 bool FileInfo::BuildTrigIDMap()
 {
-    std::streampos initialPos = m_inputfile.tellg();
-    
-     while (m_inputfile.good()){
-        if (m_inputfile.peek() == EOF) {
-            logging("End of file reached",Verbose::kInfo);
+    const uint64_t initialPos = m_cursor;
+    m_index.Clear();
+
+    // The start of each fragment: size (2 bytes), boardID (1), timestamp (8), trigID (8)
+    std::array<char,19> l_head;
+
+    // Guess the number of fragments from the size of the first one
+    if (PeekBytes(m_cursor, l_head.data(), 2)){
+        uint16_t l_firstSize = (static_cast<unsigned char>(l_head[1]) << 8) | static_cast<unsigned char>(l_head[0]);
+        if (l_firstSize > 0) m_index.Reserve((m_filesize - m_cursor) / l_firstSize + 1);
+    }
+
+    while (!AtEnd()){
+        if (!PeekBytes(m_cursor, l_head.data(), l_head.size())){
+            logging("Truncated fragment at offset " + std::to_string(m_cursor) + ", stopping the scan", Verbose::kWarn);
             break;
-        }   
-        std::streampos currentPos = m_inputfile.tellg();
-        if (m_index.find(this->GetNextTriggerID()) != m_index.end()){
-            // TrigID already there
-            m_index[this->GetNextTriggerID()].push_back(static_cast<std::uint64_t>(currentPos));
-        } else {
-            // not yet there
-            std::vector<std::uint64_t> l_vec;
-            l_vec.reserve(64);
-            l_vec.push_back(static_cast<std::uint64_t>(currentPos));
-            m_index[this->GetNextTriggerID()] = l_vec;
         }
+        FragmentRecord l_record;
+        l_record.offset = m_cursor;
+        l_record.size = (static_cast<unsigned char>(l_head[1]) << 8) | static_cast<unsigned char>(l_head[0]);
+        l_record.boardID = static_cast<uint8_t>(l_head[2]);
+        uint64_t l_triggerID = 0;
+        std::memcpy(&l_triggerID, &l_head[11], sizeof(l_triggerID));
+        l_record.trigID = static_cast<long>(l_triggerID);
+
+        if (l_record.size == 0){
+            logging("Fragment of null size at offset " + std::to_string(m_cursor) + ", stopping the scan", Verbose::kError);
+            break;
+        }
+        m_index.Add(l_record);
         // Now advance to the next event
-        m_inputfile.seekg(GetEventSize(), std::ios::cur);
-     }   
-
-    logging("The file contains " + std::to_string(m_index.size()) + " events",Verbose::kInfo);
-    uint64_t n_frag = 0;
-    for (auto it = m_index.begin(); it != m_index.end(); ++it) {
-        n_frag += (it->second).size();
+        m_cursor += l_record.size;
     }
+    logging("End of file reached",Verbose::kInfo);
+    m_cursor = initialPos;
+
+    m_index.Finalize();
 
-    logging("and  " + std::to_string(n_frag) + " fragments, for an average of " + std::to_string(static_cast<float>(n_frag)/static_cast<float>(m_index.size())) + " boards active per trigger", Verbose::kInfo);
+    logging("The file contains " + std::to_string(m_index.NTriggers()) + " events",Verbose::kInfo);
+    const uint64_t n_frag = m_index.NFragments();
+
+    logging("and  " + std::to_string(n_frag) + " fragments, for an average of " + std::to_string(static_cast<float>(n_frag)/static_cast<float>(m_index.NTriggers())) + " boards active per trigger", Verbose::kInfo);
     
     return true;
 }
 
 void FileInfo::PrintMap() const 
 {
-    // print the whole map
+    // print the whole index
 
-    for (const auto& [key, vec] : m_index) {
-        std::cout << "Key: " << key << " -> [ ";
-        for (std::size_t v : vec) {
-            std::cout << v << " ";
+    for (std::size_t i = 0; i < m_index.NTriggers(); ++i) {
+        std::cout << "Key: " << m_index.TrigID(i) << " -> [ ";
+        for (const FragmentRecord * frag = m_index.FragmentsBegin(i); frag != m_index.FragmentsEnd(i); ++frag) {
+            std::cout << frag->offset << " ";
         }
         std::cout << "]\n";
     }
@@ -212,32 +375,14 @@ long FileInfo::GetNextTriggerID()
 {
 
     // This function tries to access the next event fragment and read the trigger ID. 
-    // It restore the current position in the ifstream. 
+    // It does not change the current position in the file. 
     // It returns a negative value in case it reaches the end of file. 
     // It assumes that the file is presented with the position at the beginning of an event fragment
 
-    std::streampos currentPos = m_inputfile.tellg();
-    if (currentPos == -1)  // invalid position (e.g. already at EOF)
-        return -1;
-
     uint64_t l_triggerID = 0;
 
-
-    // we will have a trigger ID - use that to collect all boards related to this event. 
-    // Now get it and then rewind the event to current position
-
-    // Move forward 3 bytes from here
-    m_inputfile.seekg(currentPos + std::streamoff(11));
-    if (!m_inputfile.good()) {
-        m_inputfile.clear(); // restore state in case of failure
-        m_inputfile.seekg(currentPos);
-        return -1;
-    }
-    // Read the 8-byte number
-    m_inputfile.read(reinterpret_cast<char*>(&l_triggerID), sizeof(l_triggerID));
-    // Restore the original position
-    m_inputfile.seekg(currentPos);
-    
+    // The trigger ID is the 8-byte number 11 bytes after the beginning of the fragment
+    if (!PeekBytes(m_cursor + 11, &l_triggerID, sizeof(l_triggerID))) return -1;
 
     return static_cast<long>(l_triggerID);
 
@@ -245,23 +390,21 @@ long FileInfo::GetNextTriggerID()
 
 uint16_t FileInfo::GetEventSize()
 {
-    // Assumes we are at the beginning of an event fragment
+    // Assumes we are at the beginning of an event fragment. Returns 0 at the end of the file
     std::array<char,2> l_eventSize;
-    m_inputfile.read(l_eventSize.data(),2);
-    
-    static uint16_t eventSize;
+    if (!PeekBytes(m_cursor, l_eventSize.data(), 2)) return 0;
     
-    eventSize = (static_cast<unsigned char>(l_eventSize[1]) << 8) |
+    uint16_t eventSize = (static_cast<unsigned char>(l_eventSize[1]) << 8) |
             static_cast<unsigned char>(l_eventSize[0]);
 
-    m_inputfile.seekg(-2, std::ios::cur); // rewind the file
     return eventSize;
 }
 
 bool FileInfo::ReadEvent(SiPMEvent & l_event)
 {
    l_event.Reset();
-   l_event.m_triggerID = GetNextTriggerID();
+   // Timing mode fragments do not have a trigger ID
+   l_event.m_triggerID = (m_format.acqMode == AcquisitionMode::kTiming) ? -1 : GetNextTriggerID();
    if(!ReadEventFragment(l_event)) return false;
    l_event.ComputeEventTimeStamp();
    return true;
@@ -269,51 +412,92 @@ bool FileInfo::ReadEvent(SiPMEvent & l_event)
 
 bool FileInfo::ReadEventFragment(SiPMEvent & l_event)
 {
-  static uint16_t eventSize;
-  eventSize = GetEventSize();
-  std::streampos currentPos = m_inputfile.tellg();
-  std::vector<char> l_data(eventSize);
-  m_inputfile.read(l_data.data(),eventSize);
+  const uint16_t eventSize = GetEventSize();
+  const char * l_data = FragmentAt(m_cursor, eventSize);
+  if (eventSize == 0 || !l_data){
+    logging("FileInfo: truncated event fragment at offset " + std::to_string(m_cursor), Verbose::kError);
+    return false;
+  }
+  m_cursor += eventSize;
 
-  if (!l_event.ReadEventFragment(l_data,static_cast<AcquisitionMode>(m_acqMode),m_timeUnit,m_ToAToT_conv)){
+  if (!l_event.ReadEventFragment(l_data,eventSize,m_format)){
     logging ("FileInfo: Something went wrong with the event reading", Verbose::kError);
     return false;
   }
   return true;
 }
 
+bool FileInfo::SkipEventFragment()
+{
+  const uint16_t eventSize = GetEventSize();
+  if (eventSize == 0) return false;
+  m_cursor += eventSize;
+  return true;
+}
+
 bool FileInfo::ReadTrigID(long trigID, SiPMEvent & l_event)
 {
-    if (m_index.find(trigID) == m_index.end()){
+    long l_pos = m_index.Find(trigID);
+    if (l_pos < 0){
         logging("Cannot find trigger ID " + std::to_string(trigID) + " in m_index.", Verbose::kError);
         return false;
     }
+    return ReadTrigger(static_cast<std::size_t>(l_pos), l_event);
+}
+
+bool FileInfo::ReadTrigger(std::size_t i, SiPMEvent & l_event)
+{
+    const long trigID = m_index.TrigID(i);
     l_event.Reset();
     l_event.m_triggerID = trigID;
     
-    static uint16_t fragmentCounter;
-
+    const std::size_t nFragments = m_index.NFragments(i);
 
-    std::vector<std::uint64_t> & l_startingPoints = m_index[trigID];
+    if (nFragments > MAX_BOARDS){
+      throw std::runtime_error("The number of fragments (boards) cannot exceed " + std::to_string(MAX_BOARDS));
+    }
 
-    for (uint64_t evIn : l_startingPoints){
-        fragmentCounter = 0;
-        m_inputfile.seekg(evIn, std::ios::beg);
+    for (const FragmentRecord * frag = m_index.FragmentsBegin(i); frag != m_index.FragmentsEnd(i); ++frag){
+        m_cursor = frag->offset;
 
 	if(!ReadEventFragment(l_event)) return false; // stop event processing if something goes wrong with reading the event	
+    }
+
+    // Compute the event-level timeStamp
+
+    l_event.ComputeEventTimeStamp();
+
+    logging(Verbose::kPedantic, "triggerID ", trigID, " Read ", nFragments, " boards");
+
+    return true;
+}
 
-        ++fragmentCounter;
+bool FileInfo::DecodeTrigger(std::size_t i, SiPMEvent & l_event) const
+{
+    if (!m_map){
+        logging("FileInfo::DecodeTrigger needs a memory-mapped input file", Verbose::kError);
+        return false;
     }
 
-    if (fragmentCounter > MAX_BOARDS){
+    l_event.Reset();
+    l_event.m_triggerID = m_index.TrigID(i);
+
+    if (m_index.NFragments(i) > MAX_BOARDS){
       throw std::runtime_error("The number of fragments (boards) cannot exceed " + std::to_string(MAX_BOARDS));
     }
 
-    // Compute the event-level timeStamp
+    for (const FragmentRecord * frag = m_index.FragmentsBegin(i); frag != m_index.FragmentsEnd(i); ++frag){
+        if (frag->offset + frag->size > m_filesize){
+            logging("FileInfo: truncated event fragment at offset " + std::to_string(frag->offset), Verbose::kError);
+            return false;
+        }
+        if (!l_event.ReadEventFragment(m_map + frag->offset,frag->size,m_format)){
+            logging ("FileInfo: Something went wrong with the event reading", Verbose::kError);
+            return false;
+        }
+    }
 
     l_event.ComputeEventTimeStamp();
 
-    logging("triggerID " + std::to_string(trigID) + " Read " + std::to_string(fragmentCounter +1) + " boards",Verbose::kPedantic);
-
     return true;
 }
@@ -1,18 +1,22 @@
 #include "Helpers.h"
 
-Verbose VERBOSE = Verbose::kInfo;
+#include <mutex>
 
-void printToHex(const char* data, std::size_t n)
+// Shared by all the decoders in the process, which may run in different threads
+std::atomic<Verbose> VERBOSE{Verbose::kInfo};
+// Keeps the lines printed by different threads from being mixed
+std::mutex LOGGING_MUTEX;
+
+void printToHexUnchecked(const char* data, std::size_t n)
 {
-  if (VERBOSE == Verbose::kPedantic){
-    for (std::size_t i = 0; i < n; ++i) {
-        std::cout << "0x"
-                  << std::hex << std::uppercase << std::setw(2) << std::setfill('0')
-                  << (static_cast<unsigned>(static_cast<unsigned char>(data[i])))
-                  << (i + 1 < n ? " " : "\n");
-    }
-    std::cout << std::dec; // restore decimal
+  std::lock_guard<std::mutex> lock(LOGGING_MUTEX);
+  for (std::size_t i = 0; i < n; ++i) {
+      std::cout << "0x"
+                << std::hex << std::uppercase << std::setw(2) << std::setfill('0')
+                << (static_cast<unsigned>(static_cast<unsigned char>(data[i])))
+                << (i + 1 < n ? " " : "\n");
   }
+  std::cout << std::dec; // restore decimal
 }
 
 Verbose g_getVerbosity() 
@@ -24,7 +28,8 @@ void g_setVerbosity(const Verbose level)
 {VERBOSE = level;}
 
 void logging(const std::string& message, const Verbose level) {
-  if ((int)level <= (int)VERBOSE || VERBOSE == Verbose::kPedantic) {
+  if (g_isLogged(level)) {
+    std::lock_guard<std::mutex> lock(LOGGING_MUTEX);
     switch (level) {
     case Verbose::kPedantic: 
       std::cout << "[PEDANTIC]:   " << message << std::endl;
@@ -0,0 +1,206 @@
+#include "SiPMAligner.h"
+#include "Helpers.h"
+
+// std includes
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+// ROOT includes
+
+#include <TBranch.h>
+
+SiPMAligner::SiPMAligner():
+    m_inTree(NULL),
+    m_inputLayout(OutputLayout::kDense),
+    m_outTree(NULL),
+    m_trigID(-1),
+    m_nMatched(0)
+{
+    m_event.Reset();
+}
+
+bool SiPMAligner::BookOutput(TDirectory * l_dir, const std::string & l_name)
+{
+    if (!l_dir){
+        logging("SiPMAligner::BookOutput - no output directory", Verbose::kError);
+        return false;
+    }
+    l_dir->cd();
+    m_outTree = new TTree(l_name.c_str(), "Aligned SiPM data");
+
+    // Same schema as the aligned tree historically written by DR_makeRootFiles.py.
+    // HG and LG are written as Short_t straight from the uint16_t arrays, which have the same layout
+    m_outTree->Branch("TrigID", &m_trigID, "TrigID/I");
+    m_outTree->Branch("BoardTimeStamps", m_event.m_timeStamps.data(), ("BoardTimeStamps[" + std::to_string(MAX_BOARDS) + "]/D").c_str());
+    m_outTree->Branch("EventTimeStamp", &m_event.m_evTimeStamp, "EventTimeStamp/D");
+    const std::string l_size = "[" + std::to_string(MAX_BOARDS * NCHANNELS) + "]";
+    m_outTree->Branch("SiPM_HG", m_event.m_HG.data(), ("SiPM_HG" + l_size + "/S").c_str());
+    m_outTree->Branch("SiPM_LG", m_event.m_LG.data(), ("SiPM_LG" + l_size + "/S").c_str());
+    m_outTree->Branch("SiPM_ToA", m_event.m_ToA.data(), ("SiPM_ToA" + l_size + "/F").c_str());
+    m_outTree->Branch("SiPM_ToT", m_event.m_ToT.data(), ("SiPM_ToT" + l_size + "/F").c_str());
+
+    m_nMatched = 0;
+    return true;
+}
+
+void SiPMAligner::Fill(const SiPMEvent * l_event)
+{
+    if (!l_event){
+        // Placeholder for a DAQ event without SiPM data
+        m_event.m_triggerID = -1;
+        m_event.m_timeStamps.fill(0.);
+        m_event.m_evTimeStamp = -1;
+        m_event.m_HG.fill(0);
+        m_event.m_LG.fill(0);
+        m_event.m_ToA.fill(0.0f);
+        m_event.m_ToT.fill(0.0f);
+    } else {
+        if (l_event != &m_event){
+            m_event.m_triggerID = l_event->m_triggerID;
+            m_event.m_timeStamps = l_event->m_timeStamps;
+            m_event.m_evTimeStamp = l_event->m_evTimeStamp;
+            m_event.m_HG = l_event->m_HG;
+            m_event.m_LG = l_event->m_LG;
+            m_event.m_ToA = l_event->m_ToA;
+            m_event.m_ToT = l_event->m_ToT;
+        }
+        ++m_nMatched;
+    }
+    m_trigID = static_cast<Int_t>(m_event.m_triggerID);
+    m_outTree->Fill();
+}
+
+bool SiPMAligner::ConnectInput(TTree * l_tree)
+{
+    if (!l_tree){
+        logging("SiPMAligner - no SiPM input tree", Verbose::kError);
+        return false;
+    }
+    m_inTree = l_tree;
+
+    if (m_inTree->GetBranch("SiPM_Channels")) m_inputLayout = OutputLayout::kZeroSuppressed;
+    else if (m_inTree->GetBranch("SiPM_BoardHG")) m_inputLayout = OutputLayout::kBoards;
+    else if (m_inTree->GetBranch("SiPM_HG")) m_inputLayout = OutputLayout::kDense;
+    else {
+        logging("SiPMAligner - the input tree has no SiPM_HG, SiPM_BoardHG or SiPM_ChannelHG branch (Timing or Counting run?)", Verbose::kError);
+        return false;
+    }
+
+    // Same types as booked by SiPMDecoder
+    m_inTree->SetBranchAddress("TrigID", &m_event.m_triggerID);
+    m_inTree->SetBranchAddress("BoardTimeStamps", &m_event.m_timeStamps);
+    m_inTree->SetBranchAddress("EventTimeStamp", &m_event.m_evTimeStamp);
+
+    switch(m_inputLayout){
+        case OutputLayout::kBoards:
+            m_inTree->SetBranchAddress("SiPM_Boards", &m_sparseEvent.m_boards);
+            m_inTree->SetBranchAddress("SiPM_BoardHG", &m_sparseEvent.m_HG);
+            m_inTree->SetBranchAddress("SiPM_BoardLG", &m_sparseEvent.m_LG);
+            m_inTree->SetBranchAddress("SiPM_BoardToA", &m_sparseEvent.m_ToA);
+            m_inTree->SetBranchAddress("SiPM_BoardToT", &m_sparseEvent.m_ToT);
+            break;
+        case OutputLayout::kZeroSuppressed:
+            m_inTree->SetBranchAddress("SiPM_Boards", &m_sparseEvent.m_boards);
+            m_inTree->SetBranchAddress("SiPM_Channels", &m_sparseEvent.m_channels);
+            m_inTree->SetBranchAddress("SiPM_ChannelHG", &m_sparseEvent.m_HG);
+            m_inTree->SetBranchAddress("SiPM_ChannelLG", &m_sparseEvent.m_LG);
+            m_inTree->SetBranchAddress("SiPM_ChannelToA", &m_sparseEvent.m_ToA);
+            m_inTree->SetBranchAddress("SiPM_ChannelToT", &m_sparseEvent.m_ToT);
+            break;
+        default:
+            m_inTree->SetBranchAddress("SiPM_HG", &m_event.m_HG);
+            m_inTree->SetBranchAddress("SiPM_LG", &m_event.m_LG);
+            m_inTree->SetBranchAddress("SiPM_ToA", &m_event.m_ToA);
+            m_inTree->SetBranchAddress("SiPM_ToT", &m_event.m_ToT);
+    }
+    return true;
+}
+
+void SiPMAligner::ReadEntry(Long64_t l_entry)
+{
+    m_inTree->GetEntry(l_entry);
+
+    switch(m_inputLayout){
+        case OutputLayout::kBoards:
+            SiPMSparseEvent::BoardsToDense(m_sparseEvent.m_boards, m_sparseEvent.m_HG, m_event.m_HG.data());
+            SiPMSparseEvent::BoardsToDense(m_sparseEvent.m_boards, m_sparseEvent.m_LG, m_event.m_LG.data());
+            SiPMSparseEvent::BoardsToDense(m_sparseEvent.m_boards, m_sparseEvent.m_ToA, m_event.m_ToA.data());
+            SiPMSparseEvent::BoardsToDense(m_sparseEvent.m_boards, m_sparseEvent.m_ToT, m_event.m_ToT.data());
+            break;
+        case OutputLayout::kZeroSuppressed:
+            SiPMSparseEvent::ChannelsToDense(m_sparseEvent.m_channels, m_sparseEvent.m_HG, m_event.m_HG.data());
+            SiPMSparseEvent::ChannelsToDense(m_sparseEvent.m_channels, m_sparseEvent.m_LG, m_event.m_LG.data());
+            SiPMSparseEvent::ChannelsToDense(m_sparseEvent.m_channels, m_sparseEvent.m_ToA, m_event.m_ToA.data());
+            SiPMSparseEvent::ChannelsToDense(m_sparseEvent.m_channels, m_sparseEvent.m_ToT, m_event.m_ToT.data());
+            break;
+        default:
+            break;
+    }
+}
+
+bool SiPMAligner::Align(TTree * sipmTree, Long64_t nDaqEntries, long offset, TDirectory * l_dir)
+{
+    return Align(sipmTree, nDaqEntries, std::vector<Long64_t>(1, 0), std::vector<long>(1, offset), l_dir);
+}
+
+bool SiPMAligner::Align(TTree * sipmTree, Long64_t nDaqEntries, const std::vector<Long64_t> & segmentStarts, const std::vector<long> & offsets, TDirectory * l_dir)
+{
+    if (segmentStarts.empty() || segmentStarts.size() != offsets.size()){
+        logging("SiPMAligner::Align - segmentStarts and offsets must have the same, non-zero, size", Verbose::kError);
+        return false;
+    }
+    if (!ConnectInput(sipmTree)) return false;
+    if (!BookOutput(l_dir)) return false;
+
+    // Only the TrigID column is read to find the entry of each trigger
+    const Long64_t l_nSiPM = m_inTree->GetEntries();
+    std::vector<std::pair<long, Long64_t>> l_entries; // (TrigID, entry), sorted by TrigID
+    l_entries.reserve(l_nSiPM);
+    TBranch * l_trigBranch = m_inTree->GetBranch("TrigID");
+    for (Long64_t i = 0; i < l_nSiPM; ++i){
+        l_trigBranch->GetEntry(i);
+        l_entries.emplace_back(m_event.m_triggerID, i);
+    }
+    // Stable, so that the first entry is used if a TrigID appears twice (as TTree::GetEntryWithIndex)
+    std::stable_sort(l_entries.begin(), l_entries.end(),
+                     [](const std::pair<long, Long64_t> & a, const std::pair<long, Long64_t> & b){return a.first < b.first;});
+
+    logging("SiPM events: " + std::to_string(l_nSiPM), Verbose::kInfo);
+
+    // Within a segment the candidate TrigID increases with the DAQ entry: a single pass over the sorted list
+    // is enough, and the SiPM tree is read in (almost) sequential order
+    auto l_it = l_entries.begin();
+    std::size_t l_segment = 0;
+    long offset = offsets[0];
+    for (Long64_t i = 0; i < nDaqEntries; ++i){
+        if (l_segment + 1 < segmentStarts.size() && i >= segmentStarts[l_segment + 1]){
+            ++l_segment;
+            offset = offsets[l_segment];
+            // The candidate may go back if the offset decreases
+            l_it = std::lower_bound(l_entries.begin(), l_entries.end(), std::make_pair(i + offset, Long64_t(0)),
+                                    [](const std::pair<long, Long64_t> & a, const std::pair<long, Long64_t> & b){return a.first < b.first;});
+        }
+        const long l_candTrigID = i + offset;
+        while (l_it != l_entries.end() && l_it->first < l_candTrigID) ++l_it;
+
+        if (l_candTrigID >= 0 && l_it != l_entries.end() && l_it->first == l_candTrigID){
+            ReadEntry(l_it->second);
+            Fill(&m_event);
+        } else {
+            // Not written by the SiPM boards, or before the beginning of the SiPM run (negative TrigID)
+            Fill(NULL);
+        }
+    }
+
+    logging("New aligned tree length: " + std::to_string(nDaqEntries) + ", with SiPM data: " + std::to_string(m_nMatched), Verbose::kInfo);
+
+    // The input tree must not keep pointing to this object
+    m_inTree->ResetBranchAddresses();
+    m_inTree = NULL;
+
+    l_dir->cd();
+    m_outTree->Write("", TObject::kOverwrite);
+    return true;
+}
@@ -5,34 +5,205 @@
 // std includes 
 
 #include <array>
+#include <map>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <utility>
 
 // ROOT includes 
 
+#include <TROOT.h>
+
+#ifdef SIPM_HAS_RNTUPLE
+#include <ROOT/RField.hxx>
+#include <ROOT/RNTupleModel.hxx>
+#include <ROOT/RNTupleWriter.hxx>
+#include <ROOT/RNTupleWriteOptions.hxx>
+
+// Fields are booked like TTree branches, each reading from the address of the corresponding 
+// member of m_event or m_sparseEvent, so that the RNTuple is filled from the same memory as the TTree
+struct SiPMDecoder::NTupleSink
+{
+    std::unique_ptr<ROOT::RNTupleModel> model = ROOT::RNTupleModel::CreateBare();
+    std::vector<std::pair<std::string, void *>> addresses;
+    std::unique_ptr<ROOT::RNTupleWriter> writer;
+    std::unique_ptr<ROOT::REntry> entry;
+
+    template <class T> 
+    void Add(const char * name, T * address)
+    {
+        model->AddField(std::make_unique<ROOT::RField<T>>(name));
+        addresses.emplace_back(name, address);
+    }
+
+    void Open(const std::string & name, TFile & file, int compression)
+    {
+        ROOT::RNTupleWriteOptions options;
+        options.SetCompression(compression);
+        // Pages are compressed (sealed) by the ROOT thread pool if implicit multithreading is on
+        options.SetUseImplicitMT(ROOT::RNTupleWriteOptions::EImplicitMT::kDefault);
+        writer = ROOT::RNTupleWriter::Append(std::move(model), name, file, options);
+        entry = writer->CreateEntry();
+        for (auto & l_address : addresses) entry->BindRawPtr(l_address.first, l_address.second);
+    }
+
+    void Fill() {writer->Fill(*entry);}
+};
+#else
+struct SiPMDecoder::NTupleSink
+{
+    template <class T> 
+    void Add(const char *, T *) {}
+    void Open(const std::string &, TFile &, int) {}
+    void Fill() {}
+};
+#endif
+
 SiPMDecoder::SiPMDecoder(std::string filename):
     m_outfile(NULL),
+    m_ownsOutput(true),
     m_metadata(NULL),
-    m_datatree(NULL)
+    m_datatree(NULL),
+    m_ntuple(NULL),
+    m_outputFormat(0),
+    m_outputLayout(static_cast<int>(OutputLayout::kDense)),
+    m_alignEntries(-1),
+    m_alignOffset(0),
+    m_alignNext(0),
+    m_streamWindow(0),
+    m_expectedBoards(0),
+    m_nThreads(1),
+    m_enableTimingCounting(false),
+    m_compressionAlgorithm(-1),
+    m_compressionLevel(-1),
+    m_basketSize(0),
+    m_autoFlush(0)
 {
 
 }
 
 SiPMDecoder::~SiPMDecoder()
 {
-  if (m_outfile && m_outfile->IsOpen()) {
+  if (m_ownsOutput && m_outfile && m_outfile->IsOpen()) {
+    WriteOutput();
+    m_outfile->Close();
+  }
+  delete m_ntuple;
+}
+
+bool SiPMDecoder::WriteOutput()
+{
+    if (!m_outfile || !m_outfile->IsOpen()){
+        logging("Decoder: no open output file to write to", Verbose::kError);
+        return false;
+    }
     m_outfile->cd();
     if (m_metadata)  m_metadata->Write("", TObject::kOverwrite);
     if (m_datatree)  m_datatree->Write("", TObject::kOverwrite);
-    m_outfile->Close();
-  }
+    if (m_aligner.GetOutputTree()) m_aligner.GetOutputTree()->Write("", TObject::kOverwrite);
+    delete m_ntuple; // the RNTuple is committed to the file when its writer goes away
+    m_ntuple = NULL;
+    return true;
+}
+
+void SiPMDecoder::SetAlignment(Long64_t nDaqEntries, long offset)
+{
+    m_alignEntries = nDaqEntries;
+    m_alignOffset = offset;
+    m_alignNext = 0;
+}
+
+std::vector<long> SiPMDecoder::GetTriggerIDs()
+{
+    if (m_finfo.m_dataFormat.empty() && !m_finfo.ReadHeader()){
+        logging("Something wrong with reading the file header",Verbose::kError);
+        return {};
+    }
+    const AcquisitionMode l_acqMode = m_finfo.GetFragmentFormat().acqMode;
+    if (l_acqMode == AcquisitionMode::kTiming){
+        logging("Timing mode fragments have no trigger ID", Verbose::kError);
+        return {};
+    }
+    if (l_acqMode == AcquisitionMode::kCounting && !m_enableTimingCounting){
+        logging("The decoding of the Timing and Counting modes has not been validated on real data, call EnableTimingCountingModes to use it", Verbose::kError);
+        return {};
+    }
+    if (m_finfo.GetIndex().NFragments() == 0 && !m_finfo.BuildTrigIDMap()){
+        logging("Problem in building the trigID map", Verbose::kError);
+        return {};
+    }
+    return m_finfo.GetIndex().TrigIDs();
+}
+
+bool SiPMDecoder::SetOutputFormat(unsigned int format)
+{
+#ifndef SIPM_HAS_RNTUPLE
+    if (format == 1){
+        logging("This version of the SiPM converter was built without RNTuple support", Verbose::kError);
+        return false;
+    }
+#endif
+    if (format > 1){
+        logging("Unknown output format " + std::to_string(format) + ", the expected values are 0 (TTree) or 1 (RNTuple)", Verbose::kError);
+        return false;
+    }
+    m_outputFormat = format;
+    return true;
 }
 
 void SiPMDecoder::SetVerbosity(unsigned int level){
     g_setVerbosity(static_cast<Verbose>(level));
 }
 
-bool SiPMDecoder::ConnectFile(std::string filename)
+void SiPMDecoder::SetOutputLayout(unsigned int layout)
 {
-    if (!m_finfo.OpenFile(filename)){
+    if (layout > static_cast<unsigned int>(OutputLayout::kZeroSuppressed)){
+        logging("Unknown output layout " + std::to_string(layout) + ", keeping the dense one", Verbose::kError);
+        return;
+    }
+    m_outputLayout = static_cast<int>(layout);
+}
+
+bool SiPMDecoder::SetZeroSuppression(const std::vector<float> & pedestal, const std::vector<float> & sigma, float nSigma)
+{
+    if (pedestal.size() != sigma.size()){
+        logging("Zero suppression: pedestal and sigma vectors have different sizes", Verbose::kError);
+        return false;
+    }
+    std::vector<float> l_thresholds(pedestal.size());
+    for (std::size_t i = 0; i < pedestal.size(); ++i) l_thresholds[i] = pedestal[i] + nSigma * sigma[i];
+    if (!m_sparseEvent.SetThresholds(l_thresholds)) return false;
+
+    m_outputLayout = static_cast<int>(OutputLayout::kZeroSuppressed);
+    return true;
+}
+
+void SiPMDecoder::EnableThreadSafety()
+{
+    // Each decoder only touches its own FileInfo, events and output file. What is shared is ROOT 
+    // itself (gDirectory, the list of files, the type system), which needs to be protected
+    ROOT::EnableThreadSafety();
+}
+
+void SiPMDecoder::SetStreamingEventBuilding(unsigned int window, unsigned int expectedBoards)
+{
+    m_streamWindow = window;
+    m_expectedBoards = std::min<unsigned int>(expectedBoards, MAX_BOARDS);
+}
+
+void SiPMDecoder::SetImplicitMT(unsigned int nThreads)
+{
+    ROOT::EnableImplicitMT(nThreads);
+    logging("ROOT implicit multithreading enabled with " + std::to_string(ROOT::GetThreadPoolSize()) + " threads", Verbose::kInfo);
+}
+
+bool SiPMDecoder::ConnectFile(std::string filename, bool useMemoryMap)
+{
+    if (!m_finfo.OpenFile(filename, useMemoryMap)){
         return false;
     }
     return true;
@@ -50,27 +221,130 @@ bool SiPMDecoder::OpenOutput(std::string filename)
 	return false;
       }
     
+    if (m_compressionAlgorithm > 0 || m_compressionLevel >= 0){
+      // ROOT encodes the compression settings as 100 * algorithm + level
+      const int l_algorithm = m_compressionAlgorithm > 0 ? m_compressionAlgorithm : m_outfile->GetCompressionSettings() / 100;
+      const int l_level = m_compressionLevel >= 0 ? m_compressionLevel : m_outfile->GetCompressionSettings() % 100;
+      m_outfile->SetCompressionSettings(100 * l_algorithm + l_level);
+      logging("Output compression settings " + std::to_string(100 * l_algorithm + l_level), Verbose::kInfo);
+    }
+
+    m_ownsOutput = true;
+    BookOutputTrees();
+    return true;
+}
+
+bool SiPMDecoder::AttachOutput(TFile * file)
+{
+    if (!file || file->IsZombie() || !file->IsOpen() || !file->IsWritable()){
+        logging("Decoder: the output file given to AttachOutput is not open for writing", Verbose::kError);
+        return false;
+    }
+    // The compression settings are the ones of the file
+    m_outfile = file;
+    m_ownsOutput = false;
+    BookOutputTrees();
+    return true;
+}
+
+void SiPMDecoder::BookOutputTrees()
+{
     m_outfile->cd();
     m_metadata = new TTree("RunMetaData","Info about the run for SiPMs");
-    m_datatree = new TTree("SiPM_rawTree","Actual HiDRa SiPM data (no calibration)");
+    if (m_alignEntries >= 0){
+        // The aligned tree is created by m_aligner in BookDataBranches
+        if (m_outputFormat != 0 || m_outputLayout != static_cast<int>(OutputLayout::kDense)){
+            logging("The aligned SiPM tree is always a dense TTree, ignoring the output format and layout options", Verbose::kWarn);
+        }
+        m_outputFormat = 0;
+        m_outputLayout = static_cast<int>(OutputLayout::kDense);
+    } else if (m_outputFormat == 1){
+        m_ntuple = new NTupleSink();
+    } else {
+        m_datatree = new TTree("SiPM_rawTree","Actual HiDRa SiPM data (no calibration)");
+    }
+
+    // The branches of the SiPM_rawTree depend on the acquisition mode, they are created in ReadFileHeader
+}
+
+template <class T>
+void SiPMDecoder::BookField(const char * name, T * address)
+{
+    if (m_ntuple) m_ntuple->Add(name, address);
+    else m_datatree->Branch(name, address);
+}
 
+void SiPMDecoder::BookDataBranches()
+{
     // Prepare the structure of the SiPM_rawTree
 
-    m_datatree->Branch("TrigID",&m_event.m_triggerID);
-    m_datatree->Branch("BoardTimeStamps",&m_event.m_timeStamps);
-    m_datatree->Branch("EventTimeStamp",&m_event.m_evTimeStamp);  
-    m_datatree->Branch("SiPM_HG",&m_event.m_HG);  
-    m_datatree->Branch("SiPM_LG",&m_event.m_LG);  
-    m_datatree->Branch("SiPM_ToA",&m_event.m_ToA);  
-    m_datatree->Branch("SiPM_ToT",&m_event.m_ToT);  
+    const AcquisitionMode l_acqMode = m_finfo.GetFragmentFormat().acqMode;
 
-    return true;
+    if (m_alignEntries >= 0){
+        m_aligner.BookOutput(m_outfile);
+        if (m_basketSize > 0) m_aligner.GetOutputTree()->SetBasketSize("*", m_basketSize);
+        if (m_autoFlush != 0) m_aligner.GetOutputTree()->SetAutoFlush(m_autoFlush);
+        return;
+    }
+
+    if (l_acqMode != AcquisitionMode::kTiming){
+        BookField("TrigID",&m_event.m_triggerID);
+    }
+    BookField("BoardTimeStamps",&m_event.m_timeStamps);
+    BookField("EventTimeStamp",&m_event.m_evTimeStamp);  
+
+    switch(l_acqMode){
+        case AcquisitionMode::kTiming:
+            // Variable number of hits per entry, the channel is boardID*64 + channel
+            BookField("SiPM_HitChannel",&m_event.m_hitChannel);
+            BookField("SiPM_HitToA",&m_event.m_hitToA);
+            BookField("SiPM_HitToT",&m_event.m_hitToT);
+            break;
+        case AcquisitionMode::kCounting:
+            BookField("SiPM_CountChannel",&m_event.m_countChannel);
+            BookField("SiPM_Counts",&m_event.m_counts);
+            break;
+        default:
+            switch(static_cast<OutputLayout>(m_outputLayout)){
+                case OutputLayout::kBoards:
+                    // NCHANNELS values for each board in SiPM_Boards
+                    BookField("SiPM_Boards",&m_sparseEvent.m_boards);
+                    BookField("SiPM_BoardHG",&m_sparseEvent.m_HG);
+                    BookField("SiPM_BoardLG",&m_sparseEvent.m_LG);
+                    BookField("SiPM_BoardToA",&m_sparseEvent.m_ToA);
+                    BookField("SiPM_BoardToT",&m_sparseEvent.m_ToT);
+                    break;
+                case OutputLayout::kZeroSuppressed:
+                    // One value for each channel in SiPM_Channels
+                    BookField("SiPM_Boards",&m_sparseEvent.m_boards);
+                    BookField("SiPM_Channels",&m_sparseEvent.m_channels);
+                    BookField("SiPM_ChannelHG",&m_sparseEvent.m_HG);
+                    BookField("SiPM_ChannelLG",&m_sparseEvent.m_LG);
+                    BookField("SiPM_ChannelToA",&m_sparseEvent.m_ToA);
+                    BookField("SiPM_ChannelToT",&m_sparseEvent.m_ToT);
+                    break;
+                default:
+                    BookField("SiPM_HG",&m_event.m_HG);  
+                    BookField("SiPM_LG",&m_event.m_LG);  
+                    BookField("SiPM_ToA",&m_event.m_ToA);  
+                    BookField("SiPM_ToT",&m_event.m_ToT);  
+            }
+    }
+
+    if (m_ntuple){
+        m_ntuple->Open("SiPM_rawTree", *m_outfile, m_outfile->GetCompressionSettings());
+        return;
+    }
+
+    if (m_basketSize > 0) m_datatree->SetBasketSize("*", m_basketSize);
+    if (m_autoFlush != 0) m_datatree->SetAutoFlush(m_autoFlush);
 }
 
 bool SiPMDecoder::ReadFileHeader()
 {
     
-    if (!m_finfo.ReadHeader()){
+    // The header may already have been read by GetTriggerIDs
+    if (m_finfo.m_dataFormat.empty() && !m_finfo.ReadHeader()){
         logging("Something wrong with reading the file header",Verbose::kError);
         return false;
     }
@@ -89,9 +363,29 @@ bool SiPMDecoder::ReadFileHeader()
     m_metadata->Branch("ToAToT_conv", &m_finfo.m_ToAToT_conv);
     m_metadata->Branch("acqTime",     &m_finfo.m_acqTime);  
 
+    // The output layout is only used in the Spectroscopy modes
+    const AcquisitionMode l_acqMode = m_finfo.GetFragmentFormat().acqMode;
+    if (l_acqMode == AcquisitionMode::kTiming || l_acqMode == AcquisitionMode::kCounting){
+        if (!m_enableTimingCounting){
+            logging("The decoding of the Timing and Counting modes has not been validated on real data, call EnableTimingCountingModes to use it", Verbose::kError);
+            return false;
+        }
+        if (m_alignEntries >= 0){
+            logging("The alignment to the DAQ events is only possible in the Spectroscopy modes", Verbose::kError);
+            return false;
+        }
+        if (m_outputLayout != static_cast<int>(OutputLayout::kDense)){
+            logging("The output layout option only applies to the Spectroscopy modes, ignoring it", Verbose::kWarn);
+        }
+        m_outputLayout = static_cast<int>(OutputLayout::kDense);
+    }
+    m_metadata->Branch("outputLayout", &m_outputLayout);
+
     logging("About to fill the metadata tree\n", Verbose::kPedantic);
     m_metadata->Fill();
 
+    BookDataBranches();
+
     return true;
 }
 
@@ -104,7 +398,7 @@ bool SiPMDecoder::Read(bool doEventBuilding)
         }
     }
 
-    if (!m_outfile || !m_datatree){
+    if (!m_outfile || (!m_datatree && !m_ntuple && !m_aligner.GetOutputTree())){
         logging("Decoder: the pointers to output file or tree is zero, did you call OpenOutput", Verbose::kError);
         return false;
     }
@@ -117,43 +411,69 @@ bool SiPMDecoder::Read(bool doEventBuilding)
     unsigned int eventCounter = 0;
     bool goodRead = false;
 
+    if (doEventBuilding && m_finfo.GetFragmentFormat().acqMode == AcquisitionMode::kTiming){
+      logging("Timing mode fragments have no trigger ID, event building is not possible",Verbose::kInfo);
+      doEventBuilding = false;
+    }
+
+    if (m_alignEntries >= 0){
+      // The aligned tree is filled in trigger order, which only the index-based event building guarantees
+      if (!doEventBuilding || m_streamWindow > 0){
+        logging("The alignment to the DAQ events uses the index-based event building",Verbose::kWarn);
+      }
+      doEventBuilding = true;
+      m_streamWindow = 0;
+    }
+
     if (!doEventBuilding){
       logging("Event building is disabled - the output file will contain one board per entry",Verbose::kWarn);
     }
     
-    if (doEventBuilding){
+    if (doEventBuilding && m_streamWindow > 0){
+
+      goodRead = ReadStreaming(eventCounter);
+
+    } else if (doEventBuilding){
       
-      if (!m_finfo.BuildTrigIDMap()){ 
+      if (m_finfo.GetIndex().NFragments() == 0 && !m_finfo.BuildTrigIDMap()){ 
         // Quickly scanning the input file and building the map of the trigIDs 
         // and to what fragments they correspond
         logging("Problem in building the trigID map", Verbose::kError);
         return false;
       }
     
-      if (g_getVerbosity() == Verbose::kPedantic){
+      if (g_isLogged(Verbose::kPedantic)){
         m_finfo.PrintMap();
       }
-      
-      for (const auto& pair : m_finfo.GetIndexMap()) {
-        // Now looping on the trigIDs and actually reading the events
-	try { 
-	  goodRead = m_finfo.ReadTrigID(pair.first,m_event);
-	} catch (const std::runtime_error& e) {
-	  logging(e.what(),Verbose::kError);	
-	  logging("Cannot correctly read fragments in TrigID " + std::to_string(pair.first),Verbose::kError);
-	  // stop processing events
-	  break;
-	}  
-	if (!goodRead) break; // stop processing in case of a bad read
-        // Once the event is built, fill the tree 
-        m_datatree->Fill();
-	if (eventCounter%10000 == 0){
-	  logging(std::to_string(eventCounter) + " events processed ", Verbose::kInfo);
-	}
-	++eventCounter;
+
+      const TrigIndex & l_index = m_finfo.GetIndex();
+      if (m_nThreads > 1 && m_finfo.IsMemoryMapped()){
+        goodRead = ReadParallel(eventCounter);
+      } else {
+        if (m_nThreads > 1){
+          logging("Parallel decoding needs a memory-mapped input file, decoding with one thread", Verbose::kWarn);
+        }
+        for (std::size_t i = 0; i < l_index.NTriggers(); ++i) {
+          // Now looping on the trigIDs and actually reading the events
+          try { 
+            goodRead = m_finfo.ReadTrigger(i,m_event);
+          } catch (const std::runtime_error& e) {
+            logging(e.what(),Verbose::kError);	
+            logging("Cannot correctly read fragments in TrigID " + std::to_string(l_index.TrigID(i)),Verbose::kError);
+            // stop processing events
+            break;
+          }  
+          if (!goodRead) break; // stop processing in case of a bad read
+          // Once the event is built, fill the tree 
+          FillDataTree(m_event);
+          if (eventCounter%10000 == 0){
+            logging(std::to_string(eventCounter) + " events processed ", Verbose::kInfo);
+          }
+          ++eventCounter;
+        }
       }
     } else { // do not even attempt to try event building, just read one event after the other
-      while (m_finfo.InputFile()->peek() != EOF){
+      while (!m_finfo.AtEnd()){
 
         try {
 	  goodRead = m_finfo.ReadEvent(m_event);
@@ -165,20 +485,296 @@ bool SiPMDecoder::Read(bool doEventBuilding)
         }
 	if (!goodRead) break; // stop processing in case of a bad read 
         // Once the event is built, fill the output tree
-        m_datatree->Fill();
+        FillDataTree(m_event);
 	if (eventCounter%10000 == 0){
 	  logging(std::to_string(eventCounter) + " events processed ", Verbose::kInfo);
 	}
 	++eventCounter;
       }
     }
+
+    if (m_alignEntries >= 0){
+      // Placeholders for the DAQ events after the last SiPM trigger
+      FillAligned(NULL);
+      logging("Aligned SiPM tree: " + std::to_string(m_alignNext) + " entries, " + std::to_string(m_aligner.GetNMatched()) + " with SiPM data", Verbose::kInfo);
+    }
     return goodRead;
 }
 
+void SiPMDecoder::FillAligned(const SiPMEvent * l_event)
+{
+    // The triggers come in increasing order: the DAQ events between the previous trigger and this one have no SiPM data
+    const Long64_t l_entry = l_event ? l_event->m_triggerID - m_alignOffset : m_alignEntries;
+    if (l_entry < m_alignNext){
+        // Before the beginning of the DAQ run (or a repeated trigger ID)
+        logging(Verbose::kPedantic, "TrigID ", l_event->m_triggerID, " has no DAQ event, skipping it");
+        return;
+    }
+    while (m_alignNext < l_entry && m_alignNext < m_alignEntries){
+        m_aligner.Fill(NULL);
+        ++m_alignNext;
+    }
+    if (l_event && l_entry < m_alignEntries){
+        m_aligner.Fill(l_event);
+        ++m_alignNext;
+    }
+}
+
+void SiPMDecoder::FillDataTree(SiPMEvent & l_event)
+{
+    if (m_alignEntries >= 0){
+        // The aligner copies what it writes
+        FillAligned(&l_event);
+        return;
+    }
+    if (&l_event != &m_event){
+        // The branches read m_event: the event header, the hit vectors of the Timing and Counting modes, 
+        // and the dense arrays if they are written
+        m_event.m_triggerID = l_event.m_triggerID;
+        m_event.m_timeStamps = l_event.m_timeStamps;
+        m_event.m_evTimeStamp = l_event.m_evTimeStamp;
+        m_event.m_hitChannel.swap(l_event.m_hitChannel);
+        m_event.m_hitToA.swap(l_event.m_hitToA);
+        m_event.m_hitToT.swap(l_event.m_hitToT);
+        m_event.m_countChannel.swap(l_event.m_countChannel);
+        m_event.m_counts.swap(l_event.m_counts);
+        const AcquisitionMode l_acqMode = m_finfo.GetFragmentFormat().acqMode;
+        if (m_outputLayout == static_cast<int>(OutputLayout::kDense) && l_acqMode != AcquisitionMode::kTiming && l_acqMode != AcquisitionMode::kCounting){
+            m_event.m_HG = l_event.m_HG;
+            m_event.m_LG = l_event.m_LG;
+            m_event.m_ToA = l_event.m_ToA;
+            m_event.m_ToT = l_event.m_ToT;
+        }
+    }
+    if (m_outputLayout != static_cast<int>(OutputLayout::kDense)){
+        m_sparseEvent.Fill(l_event, static_cast<OutputLayout>(m_outputLayout));
+    }
+    if (m_ntuple) m_ntuple->Fill();
+    else m_datatree->Fill();
+}
+
+bool SiPMDecoder::ReadStreaming(unsigned int & eventCounter)
+{
+    logging("Streaming event building with a window of " + std::to_string(m_streamWindow) + " triggers", Verbose::kInfo);
+
+    // The open triggers. Each one is decoded in place in a slot of l_pool as its fragments come in
+    std::vector<SiPMEvent> l_pool(m_streamWindow);
+    std::vector<uint32_t> l_boardMask(m_streamWindow, 0);
+    std::vector<std::size_t> l_freeSlots;
+    for (std::size_t slot = m_streamWindow; slot > 0; --slot) l_freeSlots.push_back(slot - 1);
+    std::map<long, std::size_t> l_open; // trigID -> slot, at most m_streamWindow entries
+
+    // To recognise fragments arriving after their trigger was written out: all triggers up to
+    // l_evictedUpTo have been closed, and l_completed holds the most recent ones closed because complete
+    long l_evictedUpTo = -1;
+    std::deque<long> l_completed;
+    unsigned int l_lateFragments = 0;
+
+    auto emit = [&](std::map<long, std::size_t>::iterator it){
+        const std::size_t slot = it->second;
+        l_pool[slot].ComputeEventTimeStamp();
+        FillDataTree(l_pool[slot]);
+        if (eventCounter%10000 == 0){
+          logging(std::to_string(eventCounter) + " events processed ", Verbose::kInfo);
+        }
+        ++eventCounter;
+        l_boardMask[slot] = 0;
+        l_freeSlots.push_back(slot);
+        l_open.erase(it);
+    };
+
+    // On a bad fragment (typically the last one, truncated) the loop stops, but the triggers 
+    // already open are still written out below
+    bool l_goodRead = true;
+    while (!m_finfo.AtEnd()){
+        const long trigID = m_finfo.GetNextTriggerID();
+        if (trigID < 0){
+            logging("Cannot read the trigger ID of the next fragment", Verbose::kError);
+            l_goodRead = false;
+            break;
+        }
+
+        auto it = l_open.find(trigID);
+        if (it == l_open.end()){
+            if (trigID <= l_evictedUpTo || std::find(l_completed.begin(), l_completed.end(), trigID) != l_completed.end()){
+                // This trigger was already written out
+                logging(Verbose::kPedantic, "Fragment of TrigID ", trigID, " arrived after its trigger was closed, skipping it");
+                ++l_lateFragments;
+                if (!m_finfo.SkipEventFragment()){
+                    logging("Cannot skip the fragment of TrigID " + std::to_string(trigID), Verbose::kError);
+                    l_goodRead = false;
+                    break;
+                }
+                continue;
+            }
+            if (l_freeSlots.empty()){
+                // The window is full, close the oldest trigger
+                l_evictedUpTo = std::max(l_evictedUpTo, l_open.begin()->first);
+                emit(l_open.begin());
+            }
+            const std::size_t slot = l_freeSlots.back();
+            l_freeSlots.pop_back();
+            l_pool[slot].Reset();
+            l_pool[slot].m_triggerID = trigID;
+            it = l_open.emplace(trigID, slot).first;
+        }
+
+        const std::size_t slot = it->second;
+        bool goodRead = false;
+        try {
+            goodRead = m_finfo.ReadEventFragment(l_pool[slot]);
+        } catch (const std::exception& e) {
+            logging(e.what(),Verbose::kError);
+            goodRead = false;
+        }
+        if (!goodRead){
+            logging("Cannot correctly read fragments in TrigID " + std::to_string(trigID),Verbose::kError);
+            // The trigger of the bad fragment is dropped, as in the index-based event building
+            l_boardMask[slot] = 0;
+            l_freeSlots.push_back(slot);
+            l_open.erase(it);
+            l_goodRead = false;
+            break;
+        }
 
+        l_boardMask[slot] |= (1u << l_pool[slot].EvtFragment().m_boardID);
+        if (m_expectedBoards > 0 && static_cast<unsigned int>(popcount(l_boardMask[slot])) >= m_expectedBoards){
+            l_completed.push_back(trigID);
+            if (l_completed.size() > m_streamWindow) l_completed.pop_front();
+            emit(it);
+        }
+    }
 
+    // Flush whatever is still open, in trigger order
+    while (!l_open.empty()) emit(l_open.begin());
 
+    if (l_lateFragments > 0){
+        logging(std::to_string(l_lateFragments) + " fragments arrived after their trigger had been written out and were skipped. Consider a larger window", Verbose::kWarn);
+    }
+
+    return l_goodRead;
+}
 
+bool SiPMDecoder::ReadParallel(unsigned int & eventCounter)
+{
+    // m_nThreads workers decode batches of DECODE_BATCH consecutive triggers, each into one of 2*m_nThreads 
+    // buffers: the extra buffers let the workers decode ahead while this thread fills the tree. This thread 
+    // takes the batches in order, so the output is identical to the single-threaded one
+
+    static constexpr std::size_t DECODE_BATCH = 64;
+
+    const TrigIndex & l_index = m_finfo.GetIndex();
+    const std::size_t nTriggers = l_index.NTriggers();
+    const std::size_t nSlots = 2 * m_nThreads;
+
+    logging("Decoding " + std::to_string(nTriggers) + " triggers with " + std::to_string(m_nThreads) + " threads", Verbose::kInfo);
+
+    // A buffer and the batch decoded into it. first, n and done are shared, under l_mutex
+    struct Slot {
+        std::vector<SiPMEvent> events;
+        std::size_t first;
+        std::size_t n;
+        std::size_t nGood; // triggers correctly decoded
+        std::string error; // message of the exception stopping the decoding, if any
+        bool done;
+    };
+    std::vector<Slot> l_slots(nSlots);
+    for (Slot & l_slot : l_slots) l_slot.events.resize(DECODE_BATCH);
+
+    std::mutex l_mutex;
+    std::condition_variable l_workAvailable;
+    std::condition_variable l_batchDone;
+    std::deque<std::size_t> l_todo;   // slots to be decoded
+    std::deque<std::size_t> l_order;  // slots to be written, in trigger order
+    std::size_t l_nextTrigger = 0;
+    bool l_stop = false;
+
+    // To be called with l_mutex locked
+    auto submit = [&](std::size_t slot){
+        Slot & l_slot = l_slots[slot];
+        l_slot.first = l_nextTrigger;
+        l_slot.n = std::min(DECODE_BATCH, nTriggers - l_nextTrigger);
+        l_slot.done = false;
+        l_nextTrigger += l_slot.n;
+        l_todo.push_back(slot);
+        l_order.push_back(slot);
+    };
+
+    auto worker = [&](){
+        while (true){
+            std::size_t slot = 0;
+            {
+                std::unique_lock<std::mutex> l_lock(l_mutex);
+                l_workAvailable.wait(l_lock, [&](){return l_stop || !l_todo.empty();});
+                if (l_stop) return;
+                slot = l_todo.front();
+                l_todo.pop_front();
+            }
+            Slot & l_slot = l_slots[slot];
+            std::size_t nGood = 0;
+            std::string l_error;
+            try {
+                while (nGood < l_slot.n && m_finfo.DecodeTrigger(l_slot.first + nGood, l_slot.events[nGood])) ++nGood;
+            } catch (const std::exception& e) {
+                l_error = e.what();
+            }
+            {
+                std::lock_guard<std::mutex> l_lock(l_mutex);
+                l_slot.nGood = nGood;
+                l_slot.error = std::move(l_error);
+                l_slot.done = true;
+            }
+            l_batchDone.notify_all();
+        }
+    };
 
+    {
+        std::lock_guard<std::mutex> l_lock(l_mutex);
+        for (std::size_t slot = 0; slot < nSlots && l_nextTrigger < nTriggers; ++slot) submit(slot);
+    }
+    std::vector<std::thread> l_workers;
+    for (unsigned int t = 0; t < m_nThreads; ++t) l_workers.emplace_back(worker);
+
+    bool goodRead = true;
+    while (!l_order.empty()){
+        const std::size_t slot = l_order.front();
+        l_order.pop_front();
+        Slot & l_slot = l_slots[slot];
+        {
+            std::unique_lock<std::mutex> l_lock(l_mutex);
+            l_batchDone.wait(l_lock, [&](){return l_slot.done;});
+        }
 
+        for (std::size_t k = 0; k < l_slot.nGood; ++k){
+            FillDataTree(l_slot.events[k]);
+            if (eventCounter%10000 == 0){
+              logging(std::to_string(eventCounter) + " events processed ", Verbose::kInfo);
+            }
+            ++eventCounter;
+        }
 
+        if (l_slot.nGood < l_slot.n){
+            // stop processing events at the first bad trigger, as in the single-threaded case
+            if (!l_slot.error.empty()) logging(l_slot.error,Verbose::kError);
+            logging("Cannot correctly read fragments in TrigID " + std::to_string(l_index.TrigID(l_slot.first + l_slot.nGood)),Verbose::kError);
+            goodRead = false;
+            break;
+        }
+
+        {
+            std::lock_guard<std::mutex> l_lock(l_mutex);
+            if (l_nextTrigger < nTriggers) submit(slot);
+        }
+        l_workAvailable.notify_one();
+    }
+
+    // The workers finish the batch they are decoding, if any, before the buffers go away
+    {
+        std::lock_guard<std::mutex> l_lock(l_mutex);
+        l_stop = true;
+    }
+    l_workAvailable.notify_all();
+    for (std::thread & l_worker : l_workers) l_worker.join();
+
+    return goodRead;
+}
@@ -22,17 +22,22 @@ void SiPMEvent::Reset()
     m_LG.fill(0);
     m_ToA.fill(0.0f);
     m_ToT.fill(0.0f);
+    m_hitChannel.clear();
+    m_hitToA.clear();
+    m_hitToT.clear();
+    m_countChannel.clear();
+    m_counts.clear();
 
     m_triggerID = -1;
     m_fragment.Reset();
     
 }
 
-bool SiPMEvent::ReadEventFragment(const std::vector<char> & l_data, AcquisitionMode l_acqMode, int l_timeUnit,float l_conversion)
+bool SiPMEvent::ReadEventFragment(const char * l_data, std::size_t l_size, const FragmentFormat & l_format)
 {
   bool correctlyRead = false;
   try {
-    correctlyRead = m_fragment.Read(l_data,l_acqMode, l_timeUnit,l_conversion);
+    correctlyRead = m_fragment.Read(l_data,l_size,l_format);
   } catch (const std::runtime_error& e) {
     std::cerr << "Caught error: " << e.what() << std::endl;
     logging ("SiPMEvent::ReadEventFragment - Something went wrong with the event reading", Verbose::kError);
@@ -47,6 +52,13 @@ bool SiPMEvent::ReadEventFragment(const std::vector<char> & l_data, AcquisitionM
         std::copy_n(m_fragment.m_LG.data(), NCHANNELS, m_LG.data() + m_fragment.m_boardID * NCHANNELS);   
         std::copy_n(m_fragment.m_ToT.data(), NCHANNELS, m_ToT.data() + m_fragment.m_boardID * NCHANNELS);
         std::copy_n(m_fragment.m_ToA.data(), NCHANNELS, m_ToA.data() + m_fragment.m_boardID * NCHANNELS);
+
+        const uint16_t l_offset = m_fragment.m_boardID * NCHANNELS;
+        for (uint8_t ch : m_fragment.m_hitChannel) m_hitChannel.push_back(l_offset + ch);
+        m_hitToA.insert(m_hitToA.end(), m_fragment.m_hitToA.begin(), m_fragment.m_hitToA.end());
+        m_hitToT.insert(m_hitToT.end(), m_fragment.m_hitToT.begin(), m_fragment.m_hitToT.end());
+        for (uint8_t ch : m_fragment.m_countChannel) m_countChannel.push_back(l_offset + ch);
+        m_counts.insert(m_counts.end(), m_fragment.m_counts.begin(), m_fragment.m_counts.end());
     }
 
     return true;
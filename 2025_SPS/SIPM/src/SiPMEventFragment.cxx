@@ -38,45 +38,133 @@ void SiPMEventFragment::Reset()
     m_LG.fill(0);
     m_ToA.fill(0.0f);
     m_ToT.fill(0.0f);
-}
 
-bool SiPMEventFragment::ReadCounting(const std::vector<char>& l_data)
-{
-    logging("Acquisition modes different from Spectroscopy or SpectroscopyTiming are not implemented yet",Verbose::kError);
-    return false;
+    m_hitChannel.clear();
+    m_hitToA.clear();
+    m_hitToT.clear();
+    m_countChannel.clear();
+    m_counts.clear();
 }
 
-bool SiPMEventFragment::ReadTiming(const std::vector<char>& l_data)
+bool SiPMEventFragment::ReadCounting(const char * l_data, std::size_t l_size, const FragmentFormat &)
 {
-    logging("Acquisition modes different from Spectroscopy or SpectroscopyTiming are not implemented yet",Verbose::kError);
-    return false;
+    // Same header as Spectroscopy. The payload has, for each channel in the mask, the channel ID (1 byte) 
+    // and the number of counts in the dwell time (4 bytes). The format is not needed, the parameter 
+    // is there for FragmentFormat::Decoder
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(l_data);
+    const uint8_t* end = p + l_size;
+
+    if (l_size < FRAGMENT_HEADER_SIZE){
+        throw std::runtime_error("Event fragment of " + std::to_string(l_size) + " bytes is shorter than its header");
+    }
+
+    uint64_t channelMask = 0;
+    ReadHeader(p,channelMask);
+
+    const uint8_t nChannelsActive = popcount(channelMask);
+    if (p + 5 * std::size_t(nChannelsActive) > end){
+        throw std::runtime_error("Counting fragment too short for " + std::to_string(nChannelsActive) + " channels");
+    }
+
+    m_countChannel.resize(nChannelsActive);
+    m_counts.resize(nChannelsActive);
+    for (uint8_t n_ch = 0; n_ch < nChannelsActive; ++n_ch){
+        read_le<uint8_t>(&m_countChannel[n_ch],p);
+        read_le<uint32_t>(&m_counts[n_ch],p);
+        if (m_countChannel[n_ch] >= NCHANNELS){
+            throw std::runtime_error("Corrupted payload for channel " + std::to_string(m_countChannel[n_ch]));
+        }
+        logging(Verbose::kPedantic, "Channel ", m_countChannel[n_ch], ": counts ", m_counts[n_ch]);
+    }
+
+    return true;
 }
 
-bool SiPMEventFragment::ReadSpectroscopy(const std::vector<char>& l_data)
+bool SiPMEventFragment::ReadTiming(const char * l_data, std::size_t l_size, const FragmentFormat & l_format)
 {
-    // Spectroscopy is identical to Spectroscopy & Timing - the only difference is in the payload. 
-    return ReadSpectroscopyTiming(l_data);
+    // Header: size (2 bytes), boardID (1), timestamp (8), number of hits (2). Then for each hit: 
+    // channel ID (1), data type (1), then ToA and/or ToT according to the data type and the time unit
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(l_data);
+    const uint8_t* end = p + l_size;
+
+    if (l_size < TIMING_HEADER_SIZE){
+        throw std::runtime_error("Event fragment of " + std::to_string(l_size) + " bytes is shorter than its header");
+    }
+
+    uint16_t nHits = 0;
+    read_le<uint16_t>(&m_eventSize,p);
+    read_le<uint8_t>(&m_boardID,p);
+    read_le<double>(&m_timeStamp,p);
+    read_le<uint16_t>(&nHits,p);
+
+    logging(Verbose::kPedantic, "m_boardID =  ", m_boardID, ", ", nHits, " hits");
+
+    m_hitChannel.resize(nHits);
+    m_hitToA.assign(nHits, 0.0f);
+    m_hitToT.assign(nHits, 0.0f);
+
+    uint8_t datatype = 0;
+    uint32_t i_ToA = 0;
+    uint16_t i_ToT = 0;
+
+    for (uint16_t n_hit = 0; n_hit < nHits; ++n_hit){
+        if (p + 2 > end) throw std::runtime_error("Event fragment payload shorter than expected");
+        read_le<uint8_t>(&m_hitChannel[n_hit],p);
+        read_le<uint8_t>(&datatype,p);
+
+        if (m_hitChannel[n_hit] >= NCHANNELS || p + channelPayloadSize(datatype,l_format.timeUnit) > end){
+            throw std::runtime_error("Corrupted payload for hit " + std::to_string(n_hit));
+        }
+
+        if (l_format.timeUnit == 0){
+            if (datatype & CHTYPE_HAS_TOA) {
+                read_le<uint32_t>(&i_ToA,p);
+                m_hitToA[n_hit] = l_format.conversion * float(i_ToA);
+            }
+            if (datatype & CHTYPE_HAS_TOT) {
+                read_le<uint16_t>(&i_ToT,p);
+                m_hitToT[n_hit] = l_format.conversion * float(i_ToT);
+            }
+        } else {
+            if (datatype & CHTYPE_HAS_TOA) read_le<float>(&m_hitToA[n_hit],p);
+            if (datatype & CHTYPE_HAS_TOT) read_le<float>(&m_hitToT[n_hit],p);
+        }
+
+        logging(Verbose::kPedantic, "Hit ", n_hit, ": channel ", m_hitChannel[n_hit], "; ToA ", m_hitToA[n_hit], "; ToT ", m_hitToT[n_hit]);
+    }
+
+    return true;
 }
 
-bool SiPMEventFragment::ReadSpectroscopyTiming(const std::vector<char>& l_data, int l_timeUnit, float l_conversion)
+void SiPMEventFragment::ReadHeader(const uint8_t* & p, uint64_t & channelMask)
 {
-    const uint8_t* p = reinterpret_cast<const uint8_t*>(l_data.data());
-    
     read_le<uint16_t>(&m_eventSize,p);
     read_le<uint8_t>(&m_boardID,p);
     read_le<double>(&m_timeStamp,p);
     read_le<uint64_t>(&m_triggerID,p);
-    static uint64_t channelMask;
     read_le<uint64_t>(&channelMask,p);
+    std::memcpy(m_channelMask, &channelMask, 8);
+}
+
+template <int TimeUnit>
+bool SiPMEventFragment::ReadSpectroscopyTiming(const char * l_data, std::size_t l_size, const FragmentFormat & l_format)
+{
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(l_data);
+    const uint8_t* end = p + l_size;
 
-    logging("The event header is ",Verbose::kPedantic);
-    logging("m_eventSize =  " + std::to_string(m_eventSize),Verbose::kPedantic);
-    logging("m_boardID =  " + std::to_string(m_boardID),Verbose::kPedantic);
-    logging("m_timeStamp =  " + std::to_string(m_timeStamp),Verbose::kPedantic);
-    logging("m_triggerID =  " + std::to_string(m_triggerID),Verbose::kPedantic);
+    if (l_size < FRAGMENT_HEADER_SIZE){
+        throw std::runtime_error("Event fragment of " + std::to_string(l_size) + " bytes is shorter than its header");
+    }
     
-    std::memcpy(m_channelMask, &channelMask, 8);
+    uint64_t channelMask = 0;
+    ReadHeader(p,channelMask);
 
+    logging(Verbose::kPedantic, "The event header is ");
+    logging(Verbose::kPedantic, "m_eventSize =  ", m_eventSize);
+    logging(Verbose::kPedantic, "m_boardID =  ", m_boardID);
+    logging(Verbose::kPedantic, "m_timeStamp =  ", std::fixed, m_timeStamp);
+    logging(Verbose::kPedantic, "m_triggerID =  ", m_triggerID);
+    
     printToHex(m_channelMask,8);
     
     const uint8_t nChannelsActive = popcount(channelMask);
@@ -88,76 +176,151 @@ bool SiPMEventFragment::ReadSpectroscopyTiming(const std::vector<char>& l_data,
     }
 
     // now work on the payload
-    static uint8_t chtype;
-    chtype = 0;
-    
-    static uint8_t chID;
-    static uint32_t i_ToA;
-    static uint16_t i_ToT;
-
-    i_ToA = 0;
-    i_ToT = 0;
+    uint8_t chtype = 0;
+    uint8_t chID = 0;
+    uint32_t i_ToA = 0;
+    uint16_t i_ToT = 0;
 
     for (uint8_t n_ch = 0; n_ch < nChannelsActive; ++n_ch){
         // read the payload byte by byte 
+        if (p + 2 > end) throw std::runtime_error("Event fragment payload shorter than expected");
         read_le<uint8_t>(&chID,p);
         // now read the type and interpret it;
         read_le<uint8_t>(&chtype,p);
         // Interpret the type
-        logging("Channel type Hex",Verbose::kPedantic);
+        logging(Verbose::kPedantic, "Channel type Hex");
         printToHex(reinterpret_cast<const char*>(&chtype),1);
 
+        if (chID >= NCHANNELS || p + channelPayloadSize(chtype,TimeUnit) > end){
+            throw std::runtime_error("Corrupted payload for channel " + std::to_string(chID));
+        }
+
         if (chtype & CHTYPE_HAS_LG)  read_le<uint16_t>(&m_LG[chID],p);
         if (chtype & CHTYPE_HAS_HG)  read_le<uint16_t>(&m_HG[chID],p);
-        if (l_timeUnit == 0){ // Depending on the value of the timeUnit read from the file header, the ToA and ToT are stored as float or as int)
+        if constexpr (TimeUnit == 0){ // Depending on the value of the timeUnit read from the file header, the ToA and ToT are stored as float or as int)
             if (chtype & CHTYPE_HAS_TOA) {
                 read_le<uint32_t>(&i_ToA,p);
-                m_ToA[chID]  = l_conversion * float(i_ToA);
+                m_ToA[chID]  = l_format.conversion * float(i_ToA);
             }
             if (chtype & CHTYPE_HAS_TOT) {
                 read_le<uint16_t>(&i_ToT,p);
-                m_ToT[chID]  = l_conversion * float(i_ToT);
+                m_ToT[chID]  = l_format.conversion * float(i_ToT);
             }
-        } else if (l_timeUnit == 1) { 
+        } else { 
             if (chtype & CHTYPE_HAS_TOA) read_le<float>(&m_ToA[chID],p); 
             if (chtype & CHTYPE_HAS_TOT) read_le<float>(&m_ToT[chID],p); 
         }
 
-        logging("Channel " + std::to_string(chID) + ": HG " + std::to_string(m_HG[chID])
-                                                  + "; LG " + std::to_string(m_LG[chID])
-                                                  + "; ToA " + std::to_string(m_ToA[chID])
-                                                  + "; ToT " + std::to_string(m_ToT[chID]),
-                                                  Verbose::kPedantic);
+        logging(Verbose::kPedantic, "Channel ", chID, ": HG ", m_HG[chID], "; LG ", m_LG[chID], 
+                                    "; ToA ", m_ToA[chID], "; ToT ", m_ToT[chID]);
     }
 
     return true;
 }
 
-bool SiPMEventFragment::Read(const std::vector<char>& l_data, AcquisitionMode l_acqMode,  int l_timeUnit,float l_conversion)
+template <uint8_t ChType, int TimeUnit>
+bool SiPMEventFragment::ReadUniformLayout(const char * l_data, std::size_t l_size, const FragmentFormat & l_format)
 {
-    static bool retval;
-    retval = false;
-    this->Reset();
-   
-    switch(l_acqMode){
+    // Payload of a channel: chID (1 byte), chtype (1), then the fields flagged in chtype, in the order LG, HG, ToA, ToT
+    constexpr std::size_t stride = 2 + channelPayloadSize(ChType, TimeUnit);
+    constexpr std::size_t offsetHG = 2 + ((ChType & CHTYPE_HAS_LG) ? 2 : 0);
+    constexpr std::size_t offsetToA = offsetHG + ((ChType & CHTYPE_HAS_HG) ? 2 : 0);
+    constexpr std::size_t offsetToT = offsetToA + ((ChType & CHTYPE_HAS_TOA) ? 4 : 0);
+
+    if (l_size != FRAGMENT_HEADER_SIZE + NCHANNELS * stride) return ReadSpectroscopyTiming<TimeUnit>(l_data,l_size,l_format);
+
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(l_data);
+    const uint8_t* payload = p + FRAGMENT_HEADER_SIZE;
+
+    // Check that all channels are there, in order and all with type ChType, without branching per channel
+    uint64_t channelMask = 0;
+    std::memcpy(&channelMask, p + FRAGMENT_HEADER_SIZE - 8, 8);
+    unsigned int mismatch = (channelMask != ~uint64_t(0));
+    for (unsigned int ch = 0; ch < NCHANNELS; ++ch){
+        mismatch |= (payload[ch * stride] ^ ch) | (payload[ch * stride + 1] ^ ChType);
+    }
+    if (mismatch != 0) return ReadSpectroscopyTiming<TimeUnit>(l_data,l_size,l_format);
+
+    ReadHeader(p,channelMask);
+
+    // Now gather each quantity with fixed-stride loads
+    if constexpr ((ChType & CHTYPE_HAS_LG) != 0){
+        for (unsigned int ch = 0; ch < NCHANNELS; ++ch) std::memcpy(&m_LG[ch], payload + ch * stride + 2, 2);
+    }
+    if constexpr ((ChType & CHTYPE_HAS_HG) != 0){
+        for (unsigned int ch = 0; ch < NCHANNELS; ++ch) std::memcpy(&m_HG[ch], payload + ch * stride + offsetHG, 2);
+    }
+    if constexpr ((ChType & CHTYPE_HAS_TOA) != 0){
+        if constexpr (TimeUnit == 0){
+            for (unsigned int ch = 0; ch < NCHANNELS; ++ch){
+                uint32_t i_ToA;
+                std::memcpy(&i_ToA, payload + ch * stride + offsetToA, 4);
+                m_ToA[ch] = float(i_ToA);
+            }
+            for (unsigned int ch = 0; ch < NCHANNELS; ++ch) m_ToA[ch] *= l_format.conversion;
+        } else {
+            for (unsigned int ch = 0; ch < NCHANNELS; ++ch) std::memcpy(&m_ToA[ch], payload + ch * stride + offsetToA, 4);
+        }
+    }
+    if constexpr ((ChType & CHTYPE_HAS_TOT) != 0){
+        if constexpr (TimeUnit == 0){
+            for (unsigned int ch = 0; ch < NCHANNELS; ++ch){
+                uint16_t i_ToT;
+                std::memcpy(&i_ToT, payload + ch * stride + offsetToT, 2);
+                m_ToT[ch] = float(i_ToT);
+            }
+            for (unsigned int ch = 0; ch < NCHANNELS; ++ch) m_ToT[ch] *= l_format.conversion;
+        } else {
+            for (unsigned int ch = 0; ch < NCHANNELS; ++ch) std::memcpy(&m_ToT[ch], payload + ch * stride + offsetToT, 4);
+        }
+    }
+
+    return true;
+}
+
+template <int TimeUnit>
+FragmentFormat::Decoder SiPMEventFragment::SelectUniformDecoder(int l_chType)
+{
+    // Specialised decoders for the channel types found in practice: LG and/or HG (Spectroscopy), and everything (Spectroscopy & Timing)
+    constexpr uint8_t ALL = CHTYPE_HAS_LG | CHTYPE_HAS_HG | CHTYPE_HAS_TOA | CHTYPE_HAS_TOT;
+    switch (l_chType){
+        case CHTYPE_HAS_LG:                  return &SiPMEventFragment::ReadUniformLayout<CHTYPE_HAS_LG, TimeUnit>;
+        case CHTYPE_HAS_HG:                  return &SiPMEventFragment::ReadUniformLayout<CHTYPE_HAS_HG, TimeUnit>;
+        case CHTYPE_HAS_LG | CHTYPE_HAS_HG:  return &SiPMEventFragment::ReadUniformLayout<CHTYPE_HAS_LG | CHTYPE_HAS_HG, TimeUnit>;
+        case ALL:                            return &SiPMEventFragment::ReadUniformLayout<ALL, TimeUnit>;
+        default:                             return &SiPMEventFragment::ReadSpectroscopyTiming<TimeUnit>;
+    }
+}
+
+FragmentFormat::Decoder SiPMEventFragment::SelectDecoder(const FragmentFormat & l_format)
+{
+    switch(l_format.acqMode){
+        case AcquisitionMode::kSpectroscopy:
         case AcquisitionMode::kSpectroscopyTiming:
-            retval = ReadSpectroscopyTiming(l_data,l_timeUnit,l_conversion);
-            break;
-        // The others are not implemented for the moment
+            if (l_format.timeUnit != 0 && l_format.timeUnit != 1) break;
+            // The pedantic printout is only done by the generic decoder
+            if (l_format.uniformChType < 0 || g_isLogged(Verbose::kPedantic)){
+                return (l_format.timeUnit == 0) ? &SiPMEventFragment::ReadSpectroscopyTiming<0> : &SiPMEventFragment::ReadSpectroscopyTiming<1>;
+            }
+            return (l_format.timeUnit == 0) ? SelectUniformDecoder<0>(l_format.uniformChType) : SelectUniformDecoder<1>(l_format.uniformChType);
         case AcquisitionMode::kCounting :
-            retval = ReadCounting(l_data);
-            break;
+            return &SiPMEventFragment::ReadCounting;
         case AcquisitionMode::kTiming:
-            retval = ReadTiming(l_data);
-            break;
-        case AcquisitionMode::kSpectroscopy:
-            retval = ReadSpectroscopy(l_data);
-            break;
-        default:
-            logging("EventFragment::Read something went wrong.",Verbose::kError);
-            logging("Don't know what to do with an AcquisitionMode value " + std::to_string(static_cast<uint16_t>(l_acqMode)), Verbose::kError); 
-            retval = false;           
-    }   
-
-    return retval;
+            return &SiPMEventFragment::ReadTiming;
+    }
+    logging("EventFragment::SelectDecoder something went wrong.",Verbose::kError);
+    logging("Don't know what to do with an AcquisitionMode value " + std::to_string(static_cast<uint16_t>(l_format.acqMode)) 
+            + " and time unit " + std::to_string(l_format.timeUnit), Verbose::kError); 
+    return nullptr;
+}
+
+bool SiPMEventFragment::Read(const char * l_data, std::size_t l_size, const FragmentFormat & l_format)
+{
+    this->Reset();
+
+    // The decoder is normally chosen once per file by FileInfo::ReadHeader
+    const FragmentFormat::Decoder l_decoder = l_format.decoder ? l_format.decoder : SelectDecoder(l_format);
+    if (!l_decoder) return false;
+
+    return (this->*l_decoder)(l_data,l_size,l_format);
 }
@@ -0,0 +1,253 @@
+#include "SiPMOffsetFinder.h"
+#include "Helpers.h"
+
+// std includes
+
+#include <algorithm>
+
+// ROOT includes
+
+#include <TBranch.h>
+#include <TH1I.h>
+#include <TGraph.h>
+
+SiPMOffsetFinder::SiPMOffsetFinder(long minOffset, long maxOffset):
+    m_minOffset(minOffset),
+    m_maxOffset(maxOffset),
+    m_pedestalMask(2),
+    m_segmentLength(1000),
+    m_nDaqEntries(0),
+    m_nMissing(0),
+    m_offset(0)
+{
+    SetRange(minOffset, maxOffset);
+}
+
+void SiPMOffsetFinder::SetRange(long minOffset, long maxOffset)
+{
+    m_minOffset = std::min(minOffset, maxOffset);
+    m_maxOffset = std::max(minOffset, maxOffset);
+}
+
+bool SiPMOffsetFinder::ReadDaqTree(TTree * daqTree)
+{
+    if (!daqTree){
+        logging("SiPMOffsetFinder - no DAQ tree", Verbose::kError);
+        return false;
+    }
+    TBranch * l_maskBranch = daqTree->GetBranch("TriggerMask");
+    if (!l_maskBranch){
+        logging("SiPMOffsetFinder - the DAQ tree has no TriggerMask branch", Verbose::kError);
+        return false;
+    }
+    TBranch * l_spillBranch = daqTree->GetBranch("EventSpill");
+
+    // Only these two branches are read, into local variables. The addresses of the caller are restored at the end
+    Long64_t l_mask = 0;
+    Int_t l_spill = 0;
+    char * l_maskAddress = l_maskBranch->GetAddress();
+    char * l_spillAddress = l_spillBranch ? l_spillBranch->GetAddress() : NULL;
+    l_maskBranch->SetAddress(&l_mask);
+    if (l_spillBranch) l_spillBranch->SetAddress(&l_spill);
+
+    m_nDaqEntries = daqTree->GetEntries();
+    m_pedestals.clear();
+    m_spill.clear();
+    if (l_spillBranch) m_spill.reserve(m_nDaqEntries);
+
+    for (Long64_t i = 0; i < m_nDaqEntries; ++i){
+        l_maskBranch->GetEntry(i);
+        if (l_mask == m_pedestalMask) m_pedestals.push_back(i);
+        if (l_spillBranch){
+            l_spillBranch->GetEntry(i);
+            m_spill.push_back(l_spill);
+        }
+    }
+
+    l_maskBranch->SetAddress(l_maskAddress);
+    if (l_spillBranch) l_spillBranch->SetAddress(l_spillAddress);
+
+    logging("from PMT file: events " + std::to_string(m_nDaqEntries) + " pedestals: " + std::to_string(m_pedestals.size()), Verbose::kInfo);
+    return true;
+}
+
+bool SiPMOffsetFinder::ReadSiPMTree(TTree * sipmTree)
+{
+    if (!sipmTree){
+        logging("SiPMOffsetFinder - no SiPM tree", Verbose::kError);
+        return false;
+    }
+    TBranch * l_trigBranch = sipmTree->GetBranch("TrigID");
+    if (!l_trigBranch){
+        logging("SiPMOffsetFinder - the SiPM tree has no TrigID branch", Verbose::kError);
+        return false;
+    }
+
+    // TrigID is a long in SiPM_rawTree
+    long l_trigID = -1;
+    char * l_trigAddress = l_trigBranch->GetAddress();
+    l_trigBranch->SetAddress(&l_trigID);
+
+    const Long64_t l_nEntries = sipmTree->GetEntries();
+    m_sipmTrigIDs.clear();
+    m_sipmTrigIDs.reserve(l_nEntries);
+    for (Long64_t i = 0; i < l_nEntries; ++i){
+        l_trigBranch->GetEntry(i);
+        m_sipmTrigIDs.push_back(l_trigID);
+    }
+
+    l_trigBranch->SetAddress(l_trigAddress);
+    return true;
+}
+
+void SiPMOffsetFinder::SetSiPMTriggerIDs(const std::vector<long> & trigIDs)
+{
+    m_sipmTrigIDs = trigIDs;
+}
+
+void SiPMOffsetFinder::FillSiPMPresent()
+{
+    // Only the triggers which can be matched to a DAQ entry matter
+    m_sipmPresent.assign(m_nDaqEntries, 0);
+    for (long l_trigID : m_sipmTrigIDs){
+        if (l_trigID >= 0 && l_trigID < m_nDaqEntries) m_sipmPresent[l_trigID] = 1;
+    }
+    m_nMissing = std::count(m_sipmPresent.begin(), m_sipmPresent.end(), 0);
+    logging("from SiPM file: events with no trigger " + std::to_string(m_nMissing), Verbose::kInfo);
+}
+
+Long64_t SiPMOffsetFinder::CountMismatches(std::size_t first, std::size_t last, long offset) const
+{
+    Long64_t l_mismatches = 0;
+    for (std::size_t i = first; i < last; ++i) l_mismatches += IsMismatch(m_pedestals[i], offset);
+    return l_mismatches;
+}
+
+long SiPMOffsetFinder::FindOffset()
+{
+    if (m_nDaqEntries <= 0){
+        logging("SiPMOffsetFinder - no DAQ entries, call ReadDaqTree first", Verbose::kError);
+        return m_offset;
+    }
+    FillSiPMPresent();
+
+    m_scanOffsets.clear();
+    m_scanMismatches.clear();
+    Long64_t l_minMismatches = -1;
+    for (long l_offset = m_minOffset; l_offset <= m_maxOffset; ++l_offset){
+        const Long64_t l_mismatches = CountMismatches(0, m_pedestals.size(), l_offset);
+        m_scanOffsets.push_back(l_offset);
+        m_scanMismatches.push_back(l_mismatches);
+        if (l_minMismatches < 0 || l_mismatches < l_minMismatches){
+            l_minMismatches = l_mismatches;
+            m_offset = l_offset;
+        }
+        logging(Verbose::kInfo, "Offset ", l_offset, ": ", l_mismatches, " ped triggers where SiPM fired");
+    }
+    logging(Verbose::kInfo, "Minimum value ", l_minMismatches, " occurring for ", m_offset, " offset");
+
+    m_segmentStarts.assign(1, 0);
+    m_segmentOffsets.assign(1, m_offset);
+    return m_offset;
+}
+
+std::size_t SiPMOffsetFinder::FindSegments(unsigned int minPedestals)
+{
+    if (m_scanOffsets.empty()) FindOffset();
+    if (m_nDaqEntries <= 0) return 0;
+
+    // Boundaries of the segments: the spill changes, or every m_segmentLength entries
+    std::vector<Long64_t> l_bounds(1, 0);
+    if (!m_spill.empty()){
+        for (Long64_t i = 1; i < m_nDaqEntries; ++i){
+            if (m_spill[i] != m_spill[i-1]) l_bounds.push_back(i);
+        }
+    } else {
+        for (Long64_t i = std::max<Long64_t>(m_segmentLength, 1); i < m_nDaqEntries; i += std::max<Long64_t>(m_segmentLength, 1)) l_bounds.push_back(i);
+    }
+    l_bounds.push_back(m_nDaqEntries);
+
+    m_segmentStarts.clear();
+    m_segmentOffsets.clear();
+    long l_current = m_offset;
+    for (std::size_t k = 0; k + 1 < l_bounds.size(); ++k){
+        const std::size_t l_first = std::lower_bound(m_pedestals.begin(), m_pedestals.end(), l_bounds[k]) - m_pedestals.begin();
+        const std::size_t l_last = std::lower_bound(m_pedestals.begin(), m_pedestals.end(), l_bounds[k+1]) - m_pedestals.begin();
+
+        if (l_last - l_first >= minPedestals){
+            // Another offset is only taken if it is strictly better than the current one
+            Long64_t l_best = CountMismatches(l_first, l_last, l_current);
+            for (long l_offset = m_minOffset; l_offset <= m_maxOffset && l_best > 0; ++l_offset){
+                const Long64_t l_mismatches = CountMismatches(l_first, l_last, l_offset);
+                if (l_mismatches < l_best){
+                    l_best = l_mismatches;
+                    l_current = l_offset;
+                }
+            }
+        }
+        if (m_segmentOffsets.empty() || m_segmentOffsets.back() != l_current){
+            if (!m_segmentOffsets.empty()){
+                logging(Verbose::kWarn, "Offset changes from ", m_segmentOffsets.back(), " to ", l_current, " at DAQ entry ", l_bounds[k]);
+            }
+            m_segmentStarts.push_back(l_bounds[k]);
+            m_segmentOffsets.push_back(l_current);
+        }
+    }
+    return m_segmentStarts.size();
+}
+
+void SiPMOffsetFinder::WriteDiagnostics(TDirectory * l_dir) const
+{
+    if (!l_dir) return;
+    if (static_cast<Long64_t>(m_sipmPresent.size()) != m_nDaqEntries){
+        logging("SiPMOffsetFinder - call FindOffset before WriteDiagnostics", Verbose::kError);
+        return;
+    }
+    l_dir->cd();
+
+    // DAQ entries with no SiPM trigger
+    std::vector<double> l_missing;
+    for (Long64_t i = 0; i < m_nDaqEntries; ++i){
+        if (!m_sipmPresent[i]) l_missing.push_back(i);
+    }
+    std::vector<double> l_pedestals(m_pedestals.begin(), m_pedestals.end());
+
+    // Distance between consecutive pedestals, and between consecutive missing SiPM triggers
+    TH1I l_histo("histo","histo",100,0,100);
+    for (std::size_t i = 1; i < l_pedestals.size(); ++i) l_histo.Fill(l_pedestals[i] - l_pedestals[i-1]);
+    l_histo.Write();
+    TH1I l_histo2("histo2","histo2",100,0,100);
+    for (std::size_t i = 1; i < l_missing.size(); ++i) l_histo2.Fill(l_missing[i] - l_missing[i-1]);
+    l_histo2.Write();
+
+    std::vector<double> l_y(std::max(l_pedestals.size(), l_missing.size()), 2.);
+    TGraph l_graph(l_pedestals.size(), l_pedestals.data(), l_y.data());
+    l_graph.SetName("graph");
+    l_graph.SetTitle("pedList; EventNumber; 2");
+    l_graph.SetMarkerStyle(6);
+    l_graph.Write();
+
+    std::fill(l_y.begin(), l_y.end(), 1.);
+    TGraph l_graph2(l_missing.size(), l_missing.data(), l_y.data());
+    l_graph2.SetName("graph2");
+    l_graph2.SetTitle("SiPM no trigger; EventNumber; 1");
+    l_graph2.SetMarkerStyle(6);
+    l_graph2.SetMarkerColor(kRed);
+    l_graph2.Write();
+
+    std::vector<double> l_scanX(m_scanOffsets.begin(), m_scanOffsets.end());
+    std::vector<double> l_scanY(m_scanMismatches.begin(), m_scanMismatches.end());
+    TGraph l_graph3(l_scanX.size(), l_scanX.data(), l_scanY.data());
+    l_graph3.SetName("graph3");
+    l_graph3.SetTitle("offset scan; offset; diffLength");
+    l_graph3.SetMarkerStyle(6);
+    l_graph3.Write();
+
+    std::vector<double> l_segX(m_segmentStarts.begin(), m_segmentStarts.end());
+    std::vector<double> l_segY(m_segmentOffsets.begin(), m_segmentOffsets.end());
+    TGraph l_graph4(l_segX.size(), l_segX.data(), l_segY.data());
+    l_graph4.SetName("graph4");
+    l_graph4.SetTitle("offset per segment; first EventNumber; offset");
+    l_graph4.SetMarkerStyle(20);
+    l_graph4.Write();
+}
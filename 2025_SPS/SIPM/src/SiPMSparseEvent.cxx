@@ -0,0 +1,60 @@
+#include "SiPMSparseEvent.h"
+#include "Helpers.h"
+
+#include <algorithm>
+
+SiPMSparseEvent::SiPMSparseEvent()
+{
+    m_thresholds.fill(0.);
+}
+
+bool SiPMSparseEvent::SetThresholds(const std::vector<float> & thresholds)
+{
+    if (thresholds.size() != m_thresholds.size()){
+        logging("Zero suppression needs " + std::to_string(m_thresholds.size()) + " thresholds, got " + std::to_string(thresholds.size()), Verbose::kError);
+        return false;
+    }
+    std::copy(thresholds.begin(), thresholds.end(), m_thresholds.begin());
+    return true;
+}
+
+void SiPMSparseEvent::Fill(const SiPMEvent & l_event, OutputLayout l_layout)
+{
+    m_boards.clear();
+    m_channels.clear();
+    m_HG.clear();
+    m_LG.clear();
+    m_ToA.clear();
+    m_ToT.clear();
+
+    if (l_layout == OutputLayout::kDense) return;
+
+    // A board is present if its fragment was read, i.e. it has a time stamp
+    for (uint8_t board = 0; board < MAX_BOARDS; ++board){
+        if (l_event.m_timeStamps[board] >= 0) m_boards.push_back(board);
+    }
+
+    if (l_layout == OutputLayout::kBoards){
+        for (uint8_t board : m_boards){
+            const std::size_t first = board * NCHANNELS;
+            m_HG.insert(m_HG.end(), l_event.m_HG.begin() + first, l_event.m_HG.begin() + first + NCHANNELS);
+            m_LG.insert(m_LG.end(), l_event.m_LG.begin() + first, l_event.m_LG.begin() + first + NCHANNELS);
+            m_ToA.insert(m_ToA.end(), l_event.m_ToA.begin() + first, l_event.m_ToA.begin() + first + NCHANNELS);
+            m_ToT.insert(m_ToT.end(), l_event.m_ToT.begin() + first, l_event.m_ToT.begin() + first + NCHANNELS);
+        }
+        return;
+    }
+
+    // kZeroSuppressed
+    for (uint8_t board : m_boards){
+        const uint16_t first = board * NCHANNELS;
+        for (uint16_t index = first; index < first + NCHANNELS; ++index){
+            if (l_event.m_HG[index] <= m_thresholds[index]) continue;
+            m_channels.push_back(index);
+            m_HG.push_back(l_event.m_HG[index]);
+            m_LG.push_back(l_event.m_LG[index]);
+            m_ToA.push_back(l_event.m_ToA[index]);
+            m_ToT.push_back(l_event.m_ToT[index]);
+        }
+    }
+}
@@ -0,0 +1,254 @@
+/***************************************************
+## \file testConcurrentDecoders
+## \brief: Runs several SiPMDecoder instances at the same time in one
+##      process, as SiPMConvert.py --nFiles does. The input is a synthetic
+##      Janus file written by the test itself: each output, concurrent or
+##      serial, must hold exactly its events, the same in the memory map,
+##      buffered, parallel and streaming paths, in the entry order of the
+##      serial run of the same path.
+##      Usage: testConcurrentDecoders [nInstances = 4] [nTriggers = 2000]
+##
+##***************************************************/
+
+#include "SiPMDecoder.h"
+#include "SiPMEvent.h"
+
+// stl includes
+
+#include <array>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// ROOT includes
+
+#include <TFile.h>
+#include <TTree.h>
+
+namespace {
+
+constexpr unsigned int N_TEST_BOARDS = 4;
+
+template <class T>
+void put(std::string & buffer, T value)
+{
+    char l_bytes[sizeof(T)];
+    std::memcpy(l_bytes, &value, sizeof(T)); // Janus files are little endian, as the hosts we run on
+    buffer.append(l_bytes, sizeof(T));
+}
+
+// Janus 3.3 file in Spectroscopy+Timing mode (timeUnit = LSB): N_TEST_BOARDS fragments per trigger, neighbouring
+// fragments swapped every third one as Janus does, and one board missing every 7 triggers
+bool writeInputFile(const std::string & filename, unsigned int nTriggers)
+{
+    std::string l_data;
+    put<uint8_t>(l_data, 3); put<uint8_t>(l_data, 3); // data format
+    put<uint8_t>(l_data, 4); put<uint8_t>(l_data, 2); put<uint8_t>(l_data, 0); // software version
+    put<uint16_t>(l_data, 5202); // board type
+    put<uint16_t>(l_data, 131); // run number
+    put<uint8_t>(l_data, static_cast<uint8_t>(AcquisitionMode::kSpectroscopyTiming));
+    put<uint16_t>(l_data, 4096); // energy histogram bins
+    put<uint8_t>(l_data, 0); // time unit
+    put<float>(l_data, 0.5f); // ToA/ToT conversion
+    put<uint64_t>(l_data, 1750000000000ULL); // acquisition time (ms)
+
+    std::vector<std::string> l_fragments;
+    for (unsigned int trig = 0; trig < nTriggers; ++trig){
+        for (unsigned int board = 0; board < N_TEST_BOARDS; ++board){
+            if (trig % 7 == 3 && board == 2) continue;
+            std::string l_body;
+            put<uint8_t>(l_body, board);
+            put<double>(l_body, 1000. + trig);
+            put<uint64_t>(l_body, trig);
+            put<uint64_t>(l_body, ~0ULL); // channel mask
+            for (unsigned int ch = 0; ch < NCHANNELS; ++ch){
+                put<uint8_t>(l_body, ch);
+                put<uint8_t>(l_body, 0x33); // LG, HG, ToA and ToT
+                put<uint16_t>(l_body, (trig + ch) % 4096);
+                put<uint16_t>(l_body, (trig * 3 + ch + board) % 4096);
+                put<uint32_t>(l_body, trig + ch);
+                put<uint16_t>(l_body, ch);
+            }
+            std::string l_fragment;
+            put<uint16_t>(l_fragment, l_body.size() + 2);
+            l_fragments.push_back(l_fragment + l_body);
+        }
+    }
+    for (std::size_t i = 0; i + 1 < l_fragments.size(); i += 3) std::swap(l_fragments[i], l_fragments[i + 1]);
+    for (const std::string & l_fragment : l_fragments) l_data += l_fragment;
+
+    std::ofstream l_file(filename, std::ios::binary);
+    l_file.write(l_data.data(), l_data.size());
+    return l_file.good();
+}
+
+// The decoding path of instance i: memory map, buffered stream, parallel decoding and streaming event building
+bool convert(const std::string & input, const std::string & output, unsigned int instance)
+{
+    SiPMDecoder l_decoder;
+    l_decoder.SetVerbosity(1);
+    const unsigned int l_path = instance % 4;
+    if (l_path == 1) l_decoder.SetNThreads(2);
+    if (l_path == 3) l_decoder.SetStreamingEventBuilding(16, N_TEST_BOARDS);
+    return l_decoder.ConnectFile(input, l_path != 2) && l_decoder.OpenOutput(output) &&
+        l_decoder.ReadFileHeader() && l_decoder.Read(true);
+    // the destructor writes and closes the output
+}
+
+// The content of an entry of the SiPM_rawTree which is compared between the decoding paths
+struct TestEvent
+{
+    std::array<double,MAX_BOARDS> timeStamps;
+    double evTimeStamp;
+    std::array<uint16_t,MAX_BOARDS*NCHANNELS> HG;
+    std::array<uint16_t,MAX_BOARDS*NCHANNELS> LG;
+    std::array<float,MAX_BOARDS*NCHANNELS> ToA;
+    std::array<float,MAX_BOARDS*NCHANNELS> ToT;
+
+    bool operator==(const TestEvent & other) const
+    {
+        return timeStamps == other.timeStamps && evTimeStamp == other.evTimeStamp && HG == other.HG &&
+            LG == other.LG && ToA == other.ToA && ToT == other.ToT;
+    }
+};
+
+// The SiPM_rawTree of a decoded file: its events by trigger ID, and the trigger IDs in the order of the entries
+struct TestOutput
+{
+    std::map<long,TestEvent> events;
+    std::vector<long> order;
+};
+
+bool readOutput(const std::string & filename, TestOutput & output)
+{
+    TFile * l_file = TFile::Open(filename.c_str());
+    if (!l_file || l_file->IsZombie()){
+        std::cerr << "testConcurrentDecoders: cannot open " << filename << std::endl;
+        delete l_file;
+        return false;
+    }
+    TTree * l_tree = NULL;
+    l_file->GetObject("SiPM_rawTree", l_tree);
+    bool l_good = l_tree != NULL;
+    if (l_good){
+        SiPMEvent l_event;
+        l_tree->SetBranchAddress("TrigID", &l_event.m_triggerID);
+        l_tree->SetBranchAddress("BoardTimeStamps", &l_event.m_timeStamps);
+        l_tree->SetBranchAddress("EventTimeStamp", &l_event.m_evTimeStamp);
+        l_tree->SetBranchAddress("SiPM_HG", &l_event.m_HG);
+        l_tree->SetBranchAddress("SiPM_LG", &l_event.m_LG);
+        l_tree->SetBranchAddress("SiPM_ToA", &l_event.m_ToA);
+        l_tree->SetBranchAddress("SiPM_ToT", &l_event.m_ToT);
+        for (Long64_t ev = 0; ev < l_tree->GetEntries() && l_good; ++ev){
+            l_tree->GetEntry(ev);
+            const TestEvent l_testEvent = {l_event.m_timeStamps, l_event.m_evTimeStamp, l_event.m_HG, l_event.m_LG, l_event.m_ToA, l_event.m_ToT};
+            l_good = output.events.emplace(l_event.m_triggerID, l_testEvent).second;
+            if (!l_good) std::cerr << "testConcurrentDecoders: trigger " << l_event.m_triggerID << " written twice in " << filename << std::endl;
+            output.order.push_back(l_event.m_triggerID);
+        }
+    } else {
+        std::cerr << "testConcurrentDecoders: no SiPM_rawTree in " << filename << std::endl;
+    }
+    l_file->Close();
+    delete l_file;
+    return l_good;
+}
+
+// Checks the decoded events against what writeInputFile wrote
+bool checkPattern(const std::string & filename, const TestOutput & output, unsigned int nTriggers)
+{
+    if (output.order.size() != nTriggers || output.events.size() != nTriggers){
+        std::cerr << "testConcurrentDecoders: " << output.order.size() << " entries in " << filename << ", expected " << nTriggers << std::endl;
+        return false;
+    }
+    for (unsigned int trig = 0; trig < nTriggers; ++trig){
+        const auto l_found = output.events.find(trig);
+        if (l_found == output.events.end()){
+            std::cerr << "testConcurrentDecoders: trigger " << trig << " missing in " << filename << std::endl;
+            return false;
+        }
+        const TestEvent & l_event = l_found->second;
+        bool l_good = l_event.evTimeStamp == 1000. + trig;
+        for (unsigned int board = 0; board < MAX_BOARDS && l_good; ++board){
+            const bool l_present = board < N_TEST_BOARDS && !(trig % 7 == 3 && board == 2);
+            l_good = l_event.timeStamps[board] == (l_present ? 1000. + trig : -1.);
+            for (unsigned int ch = 0; ch < NCHANNELS && l_good; ++ch){
+                const unsigned int index = board * NCHANNELS + ch;
+                l_good = l_event.LG[index] == (l_present ? (trig + ch) % 4096 : 0) &&
+                    l_event.HG[index] == (l_present ? (trig * 3 + ch + board) % 4096 : 0) &&
+                    l_event.ToA[index] == (l_present ? 0.5f * float(trig + ch) : 0.f) &&
+                    l_event.ToT[index] == (l_present ? 0.5f * float(ch) : 0.f);
+            }
+        }
+        if (!l_good){
+            std::cerr << "testConcurrentDecoders: trigger " << trig << " of " << filename << " is not the one written" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char ** argv)
+{
+    const unsigned int nInstances = argc > 1 ? std::atoi(argv[1]) : 4;
+    const unsigned int nTriggers = argc > 2 ? std::atoi(argv[2]) : 2000;
+
+    const std::string input = "testConcurrentDecoders.dat";
+    if (!writeInputFile(input, nTriggers)){
+        std::cerr << "testConcurrentDecoders: cannot write " << input << std::endl;
+        return 1;
+    }
+
+    // The reference: the same decoders, one after the other
+    for (unsigned int i = 0; i < nInstances; ++i){
+        if (!convert(input, "serial_" + std::to_string(i) + ".root", i)){
+            std::cerr << "testConcurrentDecoders: serial conversion " << i << " failed" << std::endl;
+            return 1;
+        }
+    }
+
+    SiPMDecoder::EnableThreadSafety();
+    std::vector<char> l_ok(nInstances, 0);
+    std::vector<std::thread> l_threads;
+    for (unsigned int i = 0; i < nInstances; ++i){
+        l_threads.emplace_back([&, i](){ l_ok[i] = convert(input, "concurrent_" + std::to_string(i) + ".root", i); });
+    }
+    for (std::thread & l_thread : l_threads) l_thread.join();
+
+    // Every output holds the written events, the same in all the paths, and each concurrent decoder writes them in
+    // the order of the serial run of its path (the streaming event building writes the incomplete triggers later)
+    int failures = 0;
+    TestOutput reference;
+    if (!readOutput("serial_0.root", reference) || !checkPattern("serial_0.root", reference, nTriggers)) ++failures;
+    for (unsigned int i = 0; i < nInstances; ++i){
+        const std::string l_serialName = "serial_" + std::to_string(i) + ".root";
+        const std::string l_name = "concurrent_" + std::to_string(i) + ".root";
+        TestOutput l_serial;
+        TestOutput l_output;
+        if (!l_ok[i]){
+            std::cerr << "testConcurrentDecoders: concurrent conversion " << i << " failed" << std::endl;
+            ++failures;
+        } else if (!readOutput(l_serialName, l_serial) || !readOutput(l_name, l_output) ||
+                   !checkPattern(l_serialName, l_serial, nTriggers) || !checkPattern(l_name, l_output, nTriggers)){
+            ++failures;
+        } else if (l_serial.events != reference.events || l_output.events != reference.events){
+            std::cerr << "testConcurrentDecoders: " << l_name << " or " << l_serialName << " differs from serial_0.root" << std::endl;
+            ++failures;
+        } else if (l_output.order != l_serial.order){
+            std::cerr << "testConcurrentDecoders: " << l_name << " is not in the order of " << l_serialName << std::endl;
+            ++failures;
+        }
+    }
+
+    std::cout << "testConcurrentDecoders: " << nInstances - failures << "/" << nInstances << " concurrent decoders write the input events" << std::endl;
+    return failures == 0 ? 0 : 1;
+}
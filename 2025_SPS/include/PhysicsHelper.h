@@ -10,10 +10,18 @@
 #define N_PHELP_PMT 124
 #define N_PHELP_TDCS 48
 #define N_PHELP_BOARDS 16
+#define N_PHELP_SIPM_PER_BOARD (N_PHELP_SIPM / N_PHELP_BOARDS)
+#define N_PHELP_SIPM_MODULES 8
 
 // stdl includes
 
 #include <array>
+#include <limits>
+#include <string>
+#include <utility>
+#include <vector>
+
+class TFile;
 
 class PMTAuxCalibration
 {
@@ -25,15 +33,23 @@ public:
   void FillADCtoGeV(unsigned int idx, Float_t val);
   Float_t GetPMTPed(unsigned int idx);
   Float_t GetADCtoGeV(unsigned int idx);
+  // Incremented by every Fill: tells the users of the constants when to read them again
+  UInt_t GetVersion() const {return m_version;}
   void Print();
 private:
   Float_t m_ADCs_ped[N_PHELP_PMT];
   Float_t m_ADCtoGeV[N_PHELP_PMT];
+  UInt_t m_version;
 };
 
+// Constants stored as one aligned array per quantity, so that the 64 channels of a board
+// are calibrated with vector instructions
 class SiPMCalibration
 {
 public:
+  // Above this HG value the channel energy is computed from LG
+  static constexpr Short_t HG_SATURATION = 3800;
+
   SiPMCalibration();
   ~SiPMCalibration(){};
   void FillADCPedHG(unsigned int idx, Float_t val) {m_ADCPedHG[idx] = val;}
@@ -46,12 +62,15 @@ public:
   Float_t GetHGfromLG_q(unsigned int idx) {return m_HGfromLG_q[idx];}
   Float_t GetHGfromLG_m(unsigned int idx) {return m_HGfromLG_m[idx];}
   Float_t GetADCtoGeV(unsigned int idx) {return m_ADCtoGeV[idx];}
+  // Calibrated energy of the N_PHELP_SIPM_PER_BOARD channels of board, from its HG and LG values:
+  // ADCtoGeV * (HG - PedHG), or ADCtoGeV * (HGfromLG_m * (LG - PedLG) + HGfromLG_q) if HG is saturated
+  void CalibrateBoard(unsigned int board, const Short_t * HG, const Short_t * LG, Float_t * energy) const;
 private:
-  Float_t m_ADCPedHG[N_PHELP_SIPM];                                                                                                                                                                    
-  Float_t m_ADCPedLG[N_PHELP_SIPM];                                                                                                                                                                    
-  Float_t m_HGfromLG_q[N_PHELP_SIPM];                                                                                                                                                                
-  Float_t m_HGfromLG_m[N_PHELP_SIPM];                                                                                                                                                                
-  Float_t m_ADCtoGeV[N_PHELP_SIPM];  
+  alignas(64) Float_t m_ADCPedHG[N_PHELP_SIPM];
+  alignas(64) Float_t m_ADCPedLG[N_PHELP_SIPM];
+  alignas(64) Float_t m_HGfromLG_q[N_PHELP_SIPM];
+  alignas(64) Float_t m_HGfromLG_m[N_PHELP_SIPM];
+  alignas(64) Float_t m_ADCtoGeV[N_PHELP_SIPM];
 };
 
 struct DWCCalibration
@@ -62,6 +81,29 @@ struct DWCCalibration
   std::array<double,4> DWC_cent;
 };
 
+// chi = (1 - h/e of S) / (1 - h/e of C) of the PMT and SiPM sections, for the dual-readout energy
+// E = (S - chi * C) / (1 - chi). A chi left NaN (neither loaded nor fitted) gives a NaN energy for its section
+struct DRCalibration
+{
+  Double_t chiPMT = std::numeric_limits<Double_t>::quiet_NaN();
+  Double_t chiSiPM = std::numeric_limits<Double_t>::quiet_NaN();
+};
+
+// Events and beam energy used by FitDualReadoutChi. Fractions are of the beam energy, the cuts on the auxiliary
+// detectors are on pedestal-subtracted ADC counts, and the cuts with negative values are not applied
+struct DRChiFitSelection
+{
+  Double_t beamEnergy = 0.; // GeV, needed for the fit
+  Double_t minEnergyFraction = 0.3; // window on (S + C) / 2 of the whole calorimeter: muons, halo, pile-up
+  Double_t maxEnergyFraction = 1.3;
+  Double_t minSectionFraction = 0.9; // share of S + C in a section for the event to enter the fit of that section
+  Double_t maxLeakage = -1.; // totLeakage
+  Double_t maxPShower = -1.; // electrons
+  Double_t maxMCounter = -1.; // muons
+  Double_t minC1 = -1., maxC1 = -1.; // particle identification with the Cherenkov counters
+  Double_t minC2 = -1., maxC2 = -1.;
+};
+
 
 
 class PhysicsHelper
@@ -69,23 +111,94 @@ class PhysicsHelper
  public:
   PhysicsHelper(unsigned int runnumber, TTree * newtree, TTree * PMTTree, TTree * SiPMTree);
   ~PhysicsHelper();
+  // Writes Phys2025 as an RNTuple called name in outfile instead of filling newtree, which can then be null. 
+  // To be called before PrepareForRun. Returns false if the library was built without RNTuple support
+  bool SetRNTupleOutput(TFile * outfile, std::string name = "Phys2025");
+  // Writes the RNTuple to the file, to be called after Loop and before closing the file
+  void CommitOutput();
   bool PrepareForRun();
+  // Pedestals of the ADC channels: median of the pedestal events (TriggerMask 2, TDC 15 > 1200) of the whole run
+  // (l_option 0), or of windows of SetPedestalWindow entries (l_option 1, local pedestals following drifts).
+  // Windows with too few pedestal events take the pedestals of the run
   bool DeterminePMTAuxPedestals(unsigned int l_option = 0);
+  void SetPedestalWindow(Long64_t nEntries) {m_pedWindow = nEntries;}
+  // Run pedestals and their interquartile ranges, per ADC channel
+  const std::array<Float_t,N_PHELP_ADC> & GetADCPedestals() const {return m_ADCs_ped;}
+  const std::array<Float_t,N_PHELP_ADC> & GetADCPedestalIQRs() const {return m_ADCs_pedIQR;}
   bool DetermineSiPMPedestals();
 
   bool CalibratePMTAux();
   bool CalibrateDWC();
   bool CalibrateSiPMs();
+  // Event-level quantities from the calibrated PMT and SiPM energies and the leakage counters: S and C
+  // energy sums, per SiPM module too, energy-weighted barycentres and RMS widths (positive deposits only;
+  // barycentre 0 and RMS -1 if there is none), and the pedestal-subtracted sum of the leakage counters
+  bool ComputeDerivedQuantities();
+  // Dual-readout energies of the PMT and SiPM sections from the S and C sums of ComputeDerivedQuantities.
+  // The energy of a section whose chi is not set is NaN. Returns false if a chi is 1
+  bool CalibrateDualReadout();
 
   PMTAuxCalibration * GetPMTAuxCalibration() {return &m_pmtcal;}
   DWCCalibration * GetDWCCalibration(){return &m_dwccal;}
   SiPMCalibration * GetSiPMCalibration() {return &m_sipmcal;}
+  DRCalibration * GetDRCalibration() {return &m_drcal;}
+  DRChiFitSelection * GetDRChiFitSelection() {return &m_drfit;}
+
+  // Adds the dual-readout stage to Loop, with its branches totPMTDRene and totSiPMDRene. To be called before PrepareForRun
+  void EnableDualReadout(bool enable = true) {m_doDualReadout = enable;}
+  // Fits chi of both sections on the first nEntries entries (all if negative), to be called when all the other
+  // constants and the beam energy E of GetDRChiFitSelection are set. In each section 1 - S/E = chi * (1 - C/E),
+  // and chi is the slope of this line through the origin, as the ratio of the means of 1 - S/E and 1 - C/E over
+  // the events passing the selection: the photostatistical fluctuations of S and C average out, while a plain
+  // regression of S on C would be pulled towards 0 by them. Leakage out of the section (the shower is not all in
+  // it), muons and halo particles pull chi towards 1, hence the selection. Runs with the beam on one section only
+  // fit that one. The chi which cannot be fitted (too few events, slope not below 1) are left as they are, and 
+  // false is returned
+  bool FitDualReadoutChi(Long64_t nEntries = 100000);
   
+  // Number of threads used by Loop. With more than one, the entries are split in batches calibrated by
+  // worker threads, each reading its own copy of the input trees, and written in order by the calling thread
+  void SetNThreads(unsigned int nThreads = 1) {m_nThreads = nThreads;}
+
   void Loop();
   
  private:
 
+  // Adds a branch to m_newTree, or a field to the RNTuple, and records it in m_outputFields
+  template <class T> void BookField(const char * name, T * address);
+
+  // Builds the PMT calibration plan and the table of the auxiliary channels for this run
+  void BuildPMTAuxPlan();
+  // Copies pedestals and ADCtoGeV of the PMTs in the plan from m_pmtcal
+  void UpdatePMTAuxPlan();
+  // Geometry used by ComputeDerivedQuantities for this run
+  void BuildDerivedGeometry();
+
+  // Copies the pedestals of the ADC channels read by a PMT to m_pmtcal
+  void FillPMTPedestals(const std::array<Float_t,N_PHELP_ADC> & l_ped);
+  // With local pedestals, sets the PMT pedestals to the ones of the window of entry ev
+  void UpdatePMTAuxPedestals(Long64_t ev);
+  // Pedestals of the ADC channels for the current event (local or run ones)
+  const std::array<Float_t,N_PHELP_ADC> & CurrentADCPedestals() const;
+
+  // Parallel Loop. Returns false, before processing any event, if the workers cannot be set up
+  bool LoopParallel();
+  // Reads and calibrates the entries [first, last), appending the output fields of each event to l_records.
+  // Returns false if the calibration fails, l_records then holds the events before the failing one
+  bool ProcessBatch(Long64_t first, Long64_t last, std::vector<char> & l_records);
+
   unsigned int m_runnumber;
+
+  struct NTupleSink; // defined in PhysicsHelper.cxx
+  NTupleSink * m_ntuple; //!
+  TFile * m_ntupleFile; //!
+  std::string m_ntupleName;
+
+  // Address and size of every output field, in booking order: one event of the parallel Loop is copied
+  // from the worker to these addresses before filling
+  std::vector<std::pair<void *, std::size_t>> m_outputFields; //!
+  std::size_t m_recordSize;
+  unsigned int m_nThreads;
   
   TTree * m_newTree;
   TTree * m_PMTTree;
@@ -100,6 +213,12 @@ class PhysicsHelper
   std::array<Short_t,N_PHELP_SIPM> m_SiPM_HG;
   std::array<Short_t,N_PHELP_SIPM> m_SiPM_LG;
   std::array<Float_t,N_PHELP_ADC> m_ADCs_ped;
+  std::array<Float_t,N_PHELP_ADC> m_ADCs_pedIQR;
+
+  // Local pedestals: one set per window of m_pedWindow entries, empty if the run pedestals are used
+  Long64_t m_pedWindow;
+  std::vector<std::array<Float_t,N_PHELP_ADC>> m_localPeds;
+  Long64_t m_currentPedWindow;
 
   std::array<Float_t,N_PHELP_PMT> m_PMT;
   std::array<Float_t,N_PHELP_SIPM> m_SiPM;
@@ -113,12 +232,48 @@ class PhysicsHelper
   Float_t XDWC1,XDWC2,YDWC1,YDWC2;
   Float_t Veto, PShower, MCounter, C1, C2, C3, TailC;
 
+  // Derived quantities
+  Float_t totPMTSene, totPMTCene;
+  Float_t PMTS_X, PMTS_Y, PMTS_RMSX, PMTS_RMSY;
+  Float_t PMTC_X, PMTC_Y, PMTC_RMSX, PMTC_RMSY;
+  Float_t totSiPMSene, totSiPMCene;
+  std::array<Float_t,N_PHELP_SIPM_MODULES> SiPMSene_module;
+  std::array<Float_t,N_PHELP_SIPM_MODULES> SiPMCene_module;
+  Float_t SiPMS_X, SiPMS_Y, SiPMS_RMSX, SiPMS_RMSY;
+  Float_t SiPMC_X, SiPMC_Y, SiPMC_RMSX, SiPMC_RMSY;
+  Float_t totLeakage;
+
   PMTAuxCalibration m_pmtcal;
 
+  // PMT calibration plan: entry k calibrates ADC channel m_planADC[k] into PMT m_planPMT[k], with pedestal
+  // and ADCtoGeV copied from m_pmtcal (version m_planVersion)
+  std::vector<UInt_t> m_planADC;
+  std::vector<UInt_t> m_planPMT;
+  std::vector<Float_t> m_planPed;
+  std::vector<Float_t> m_planGain;
+  UInt_t m_planVersion;
+  // Auxiliary detectors: output variable and ADC channel
+  std::vector<std::pair<Float_t *, UInt_t>> m_auxChannels; //!
+  // ADC channels of the leakage counters
+  std::vector<UInt_t> m_leakageADC;
+
+  // Geometry of the derived quantities: position of the PMTs, 1 for the S and 0 for the C channels,
+  // and module (from 0) of every SiPM board. The SiPM positions are the SiPMCaloMapping tables
+  alignas(64) std::array<Float_t,N_PHELP_PMT> m_PMTX;
+  alignas(64) std::array<Float_t,N_PHELP_PMT> m_PMTY;
+  alignas(64) std::array<Float_t,N_PHELP_PMT> m_PMTIsS;
+  alignas(64) std::array<Float_t,N_PHELP_SIPM> m_SiPMIsS;
+  std::array<UInt_t,N_PHELP_BOARDS> m_SiPMBoardModule;
+
   DWCCalibration m_dwccal;
 
   SiPMCalibration m_sipmcal;
 
+  bool m_doDualReadout;
+  DRCalibration m_drcal;
+  DRChiFitSelection m_drfit;
+  Float_t totPMTDRene, totSiPMDRene;
+
 };
 
 #endif
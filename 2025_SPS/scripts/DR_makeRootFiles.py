@@ -2,12 +2,10 @@
 
 import ROOT
 import os
-from array import array
-import numpy as np
 import glob,time
-import ctypes
 
 import DRrootify
+import DRbz2blocks
 import bz2
 import SiPMConvert
 
@@ -24,6 +22,12 @@ DaqTreeName = "CERNSPS2025"
 EventInfoTreeName = "RunMetaData"
 EvtOffset = -1000
 doNotMerge = False
+fusedPipeline = False
+offsetRange = (-4, 4)
+perSpillOffset = False
+EvtSegments = None # (first DAQ entries, offsets) if the offset is determined spill by spill
+DaqRootifier = None # the DRrootify object holding the rootified DAQ tree
+daqWorkers = 1 # processes decompressing and decoding the bz2 DAQ file, block by block
 
 
 
@@ -69,171 +73,118 @@ def CreateBlendedFile(SiPMInputTree,EventInfoTree,DaqInputTree,outputfilename):
     OutputFile.cd()
     newEventInfoTree.Write("", ROOT.TObject.kOverwrite)
 
-    # building a list of available trigID
-    #TrigID_to_entry = {}
-    TrigIDs = []
-    SiPMInputTree.BuildIndex("TrigID")
+    # The alignment itself is done in C++ (SiPMAligner in libSiPMConverter, loaded by SiPMConvert):
+    # entry i of SiPM_rawTree_aligned is the SiPM trigger i + EvtOffset, or an empty event with TrigID = -1
+    print("SiPM events: " + str(SiPMInputTree.GetEntries()))
+
+    aligner = ROOT.SiPMAligner()
+    if EvtSegments is not None:
+        alignedOK = aligner.Align(SiPMInputTree, newDaqInputTree.GetEntries(), EvtSegments[0], EvtSegments[1], OutputFile)
+    else:
+        alignedOK = aligner.Align(SiPMInputTree, newDaqInputTree.GetEntries(), EvtOffset, OutputFile)
+    if not alignedOK:
+        print("Cannot align the SiPM tree to the DAQ tree")
+        OutputFile.Close()
+        return -1
+    newtree = aligner.GetOutputTree()
 
-    #for ev in enumerate(SiPMInputTree):
-    #    TrigIDs.append(ev.TrigID)
-        
-    print("SiPM events: " + str(SiPMInputTree.GetEntries()))   
-#    TrigIDs[:] = [n for n in TrigIDs if n >= EvtOffset]
-
-    newtree = ROOT.TTree("SiPM_rawTree_aligned", "Aligned SiPM data")
-
-    # Variabili/branches (uguali a quelli originali)
-    TrigID = np.zeros(1, dtype=np.int32)
-    BoardTimeStamps = np.zeros(16, dtype=np.float64)
-    EventTimeStamp = np.zeros(1, dtype=np.float64)
-    SiPM_HG = np.zeros(1024, dtype=np.int16)
-    SiPM_LG = np.zeros(1024, dtype=np.int16)
-    SiPM_ToA = np.zeros(1024, dtype=np.float32)
-    SiPM_ToT = np.zeros(1024, dtype=np.float32)
-
-    newtree.Branch("TrigID", TrigID, "TrigID/I")
-    newtree.Branch("BoardTimeStamps", BoardTimeStamps, "BoardTimeStamps[16]/D")
-    newtree.Branch("EventTimeStamp", EventTimeStamp, "EventTimeStamp/D")
-    newtree.Branch("SiPM_HG", SiPM_HG, "SiPM_HG[1024]/S")
-    newtree.Branch("SiPM_LG", SiPM_LG, "SiPM_LG[1024]/S")
-    newtree.Branch("SiPM_ToA", SiPM_ToA, "SiPM_ToA[1024]/F")
-    newtree.Branch("SiPM_ToT", SiPM_ToT, "SiPM_ToT[1024]/F")
-
-    # ---- loop sugli eventi del tree principale CERNSPS2025 ----
-    for i, ev in enumerate(newDaqInputTree):
-        ## try to get the entry corresponding to teh computed offset 
-#        evtid = ev.EventNumber
-        candTrigID = i + EvtOffset
-        entry_bytes = SiPMInputTree.GetEntryWithIndex(candTrigID)
-  
-        if entry_bytes > 0: ## event found 
-            TrigID[0] = SiPMInputTree.TrigID
-            BoardTimeStamps[:] = SiPMInputTree.BoardTimeStamps
-            EventTimeStamp[0] = SiPMInputTree.EventTimeStamp
-            SiPM_HG[:] = SiPMInputTree.SiPM_HG
-            SiPM_LG[:] = SiPMInputTree.SiPM_LG
-            SiPM_ToA[:] = SiPMInputTree.SiPM_ToA
-            SiPM_ToT[:] = SiPMInputTree.SiPM_ToT
-
-        else: ## the event was not found, either because not written or because candTrigID was negative (more event in Daq file 
-            TrigID[0] = -1
-            BoardTimeStamps[:] = 0
-            EventTimeStamp[0] = -1
-            SiPM_HG[:] = 0
-            SiPM_LG[:] = 0
-            SiPM_ToA[:] = 0
-            SiPM_ToT[:] = 0
-
-        newtree.Fill()
     print("New aligned tree length:", newtree.GetEntries())
     print("PMT tree length:", newDaqInputTree.GetEntries())
+    print("Aligned events with SiPM data:", aligner.GetNMatched())
     
-    OutputFile.cd()
-    newtree.Write("", ROOT.TObject.kOverwrite)
     OutputFile.Close()    
     return 0
 
-def DetermineOffset(SiPMTree,DAQTree):
+def CreateBlendedFileFused(SiPMDecoder,DaqInputTree,outputfilename):
+    """ Same as CreateBlendedFile, but the SiPM data are decoded straight into SiPM_rawTree_aligned
+        (no intermediate SiPM root file). The RunMetaData tree is written by the decoder as well
+    Args:
+        SiPMDecoder (SiPMDecoder): decoder connected to the SiPM dat file (see SiPMConvert.makeDecoder)
+        DaqInputTree (TTree): H1-H8 Tree
+        outputfilename (str): output merged root file
+
+    Returns:
+        int: 0
+    """
+
+    OutputFile = ROOT.TFile.Open(outputfilename,"recreate")
+
+    ###### The offset only needs the trigger IDs, which are taken from the index of the dat file
+
+    global EvtOffset
+    EvtOffset = DetermineOffset(None,DaqInputTree,SiPMDecoder.GetTriggerIDs())
+
+    if doNotMerge:
+        return 0
+
+    newDaqInputTree = DaqInputTree.CloneTree()
+    OutputFile.cd()
+    newDaqInputTree.Write("", ROOT.TObject.kOverwrite)
+
+    if EvtSegments is not None and len(EvtSegments[1]) > 1:
+        print("WARNING: the fused pipeline uses a single offset for the whole run, the per-spill offsets are ignored")
+    SiPMDecoder.SetAlignment(newDaqInputTree.GetEntries(), EvtOffset)
+    if not SiPMDecoder.AttachOutput(OutputFile) or not SiPMDecoder.ReadFileHeader():
+        OutputFile.Close()
+        return -1
+    if not SiPMDecoder.Read():
+        print("SiPMDecoder::Read() ERROR! Something wrong while processing the SiPM file")
+        OutputFile.Close()
+        return -1
+    SiPMDecoder.WriteOutput()
+
+    print("PMT tree length:", newDaqInputTree.GetEntries())
+
+    OutputFile.Close()
+    return 0
+
+def DetermineOffset(SiPMTree,DAQTree,sipmTrigIDs=None):
     """ Scan possible offsets to find out for which one we get the best match 
         between the pedList and the missing TriggerId which could be caused by pedestal.
-        Generate four plots:
-            - histo: TH1F of discrete difference along the pedestal series.
-            - histo2: TH1F of discrete difference of the events from SiPM file with no trigger.
+        The scan is done in C++ (SiPMOffsetFinder in libSiPMConverter), reading only the TriggerMask, 
+        EventSpill and TrigID branches. The offsets from offsetRange[0] to offsetRange[1] are tried.
+        If perSpillOffset is set, the offset is also determined spill by spill, and EvtSegments 
+        is set to the (first DAQ entry, offset) of each part of the run with a constant offset.
+        Generate five plots:
+            - histo: TH1I of discrete difference along the pedestal series.
+            - histo2: TH1I of discrete difference of the events from SiPM file with no trigger.
             - graph: TGraph of pedestals, x-axis is TriggerMask.
             - graph2: TGraph of the events from SiPM file with no trigger, x-axis is TriggerId.
             - graph3: TGraph of points of ( scanned offset, difference length ).
+            - graph4: TGraph of points of ( first entry of a segment, offset ).
 
     Args:
         SiPMTree (TTree): SiPMTreeName("SiPMData") Tree in H0 root file
         DAQTree (TTree): DaqTreeName("CERNSPS2025") Tree in H1-H8 root file
+        sipmTrigIDs (list): the SiPM TrigIDs, used instead of SiPMTree if given
 
     Returns:
         int: the Offset applied on H1-H8 matches H1-H8 to H0.
     """
-    x = array('i')
-    y = array('i')
-    xsipm = array('i')
-    ysipm = array('i')
-    ##### build a list of entries of pedestal events in the DAQ Tree
-    DAQTree.SetBranchStatus("*",0) # disable all branches
-    DAQTree.SetBranchStatus("TriggerMask",1) # only process "TriggerMask" branch
-    pedList = set() # pedestal
-    evList = set()
-    for iev,ev in enumerate(DAQTree):
-        if ev.TriggerMask == 2:
-            pedList.add(iev)
-        evList.add(iev)
-    DAQTree.SetBranchStatus("*",1)
-    ##### Now build a list of missing TriggerId in the SiPM tree
-    SiPMTree.SetBranchStatus("*",0) # disable all branches
-    SiPMTree.SetBranchStatus("TrigID",1) # only process "TriggerId" branch
-    TriggerIdList = set()
-    for ev in SiPMTree:
-        TriggerIdList.add(ev.TrigID)
-    SiPMTree.SetBranchStatus("*",1)
-    ### Find the missing TriggerId
-    TrigIdComplement = evList - TriggerIdList
-    print( "from PMT file: events "+str(len(evList))+" pedestals: "+str(len(pedList)))
-    print( "from SiPM file: events with no trigger "+str(len(TrigIdComplement)))
-    #### do some diagnostic plot
-    for p in pedList:
-        x.append(p)
-        y.append(2)
-    for p2 in TrigIdComplement:
-        xsipm.append(p2)
-        ysipm.append(1)
-    hist = ROOT.TH1I("histo","histo",100, 0, 100)
-    for i in np.diff(sorted(list(pedList))):
-        hist.Fill(i)
-    hist.Write()
-    hist2 = ROOT.TH1I("histo2","histo2",100,0,100)
-    for i in np.diff(sorted(list(TrigIdComplement))):
-        hist2.Fill(i)
-    hist2.Write()
-    x_array = array('d',x)
-    y_array = array('d',y)
-    x_ptr = ctypes.cast(x_array.buffer_info()[0], ctypes.POINTER(ctypes.c_double))
-    y_ptr = ctypes.cast(y_array.buffer_info()[0], ctypes.POINTER(ctypes.c_double))
-    graph = ROOT.TGraph(len(x_array),x_ptr,y_ptr)
-    graph.SetTitle( "pedList; EventNumber; 2" )
-    xsipm_array = array('d',xsipm)
-    ysipm_array = array('d',ysipm)
-    xsipm_ptr = ctypes.cast(xsipm_array.buffer_info()[0], ctypes.POINTER(ctypes.c_double))
-    ysipm_ptr = ctypes.cast(ysipm_array.buffer_info()[0], ctypes.POINTER(ctypes.c_double))
-    graph2 = ROOT.TGraph(len(xsipm),xsipm_ptr,ysipm_ptr)
-    graph2.SetTitle( "SiPM no trigger; EventNumber; 1" )
-    graph2.SetMarkerStyle(6)
-    graph2.SetMarkerColor(ROOT.kRed)
-    graph.SetMarkerStyle(6)
-    graph.Write()
-    graph2.Write()
-
-    ### Scan possible offsets to find out for which one we get the best match between the pedList and the missing TriggerId
-
-    minOffset = -1000
-    minLen = 10000000
-    
-    diffLen = {}
-    
-    scanned_offset = array('i')
-    scanned_diffLen = array('i')
-
-    for offset in range(-4,5):
-        offset_set = {x+offset for x in pedList}
-        diffSet =  offset_set - TrigIdComplement
-        diffLen[offset] = len(diffSet)
-        if len(diffSet) < minLen:
-            minLen = len(diffSet)
-            minOffset = offset
-        print( "Offset " + str(offset) + ": " + str(diffLen[offset]) + " ped triggers where SiPM fired")
-        scanned_offset.append(offset)
-        scanned_diffLen.append(len(diffSet))
-    print( "Minimum value " + str(minLen) + " occurring for " + str(minOffset) + " offset")
-    
-    graph3 = ROOT.TGraph(len(scanned_offset),scanned_offset,scanned_diffLen)
-    graph3.SetMarkerStyle(6)
-    graph3.SetTitle( "offset scan; offset; diffLength" )
-    graph3.Write()
+    global EvtSegments
+    finder = ROOT.SiPMOffsetFinder(offsetRange[0],offsetRange[1])
+    if not finder.ReadDaqTree(DAQTree):
+        return EvtOffset
+    if sipmTrigIDs is not None:
+        finder.SetSiPMTriggerIDs(sipmTrigIDs)
+    elif not finder.ReadSiPMTree(SiPMTree):
+        return EvtOffset
+
+    print( "from PMT file: events "+str(finder.GetNDaqEntries())+" pedestals: "+str(finder.GetNPedestals()))
+    minOffset = finder.FindOffset()
+    print( "from SiPM file: events with no trigger "+str(finder.GetNMissingSiPM()))
+    for offset, diffLen in zip(finder.GetScanOffsets(),finder.GetScanMismatches()):
+        print( "Offset " + str(offset) + ": " + str(diffLen) + " ped triggers where SiPM fired")
+    print( "Minimum value " + str(min(finder.GetScanMismatches())) + " occurring for " + str(minOffset) + " offset")
+
+    EvtSegments = None
+    if perSpillOffset:
+        finder.FindSegments()
+        EvtSegments = (finder.GetSegmentStarts(),finder.GetSegmentOffsets())
+        for start, offset in zip(EvtSegments[0],EvtSegments[1]):
+            print( "From DAQ entry " + str(start) + ": offset " + str(offset))
+
+    finder.WriteDiagnostics(ROOT.gDirectory)
 
     return minOffset
 
@@ -250,6 +201,9 @@ def doRun(runnumber,outfilename):
     if not FileCheck(inputDaqFileName):
         return False
 
+    if fusedPipeline:
+        return doRunFused(inputSiPMFileName,inputDaqFileName,outfilename)
+
     print ('Running data conversion (binary to SiPM on ' + inputSiPMFileName)
 
     SiPMConvert.runConversion(inputSiPMFileName,tmpSiPMRootFile)
@@ -269,25 +223,12 @@ def doRun(runnumber,outfilename):
     SiPMTree = t_SiPMRootFile.Get(SiPMTreeName)
     EventInfoTree = t_SiPMRootFile.Get(EventInfoTreeName)
 
-    # creating temporary ntuples Tree from DAQ txt file
-    f = None 
-    try: 
-        f = bz2.open(inputDaqFileName,'rt')
-    except: 
-        print ('ERROR! File ' + inputDaqFileName + ' not found')
-        return False
-
-    DreamDaq_rootifier = DRrootify.DRrootify()
-    DreamDaq_rootifier.drf = f
-
-    #### rootify the input data
-
-    if not DreamDaq_rootifier.ReadandRoot():
-        print("Cannot rootify file " + inputDaqFileName)
+    DaqTree = RootifyDaq(inputDaqFileName)
+    if DaqTree is None:
         return False
 
     ##### and now merge
-    retval = CreateBlendedFile(SiPMTree,EventInfoTree,DreamDaq_rootifier.tbtree,outfilename)
+    retval = CreateBlendedFile(SiPMTree,EventInfoTree,DaqTree,outfilename)
     t_SiPMRootFile.Close()
 
     if os.path.isfile(tmpSiPMRootFile):
@@ -296,6 +237,47 @@ def doRun(runnumber,outfilename):
         os.remove("temp.root")
     
     return retval 
+
+def doRunFused(inputSiPMFileName,inputDaqFileName,outfilename):
+    # The DAQ file is rootified first, then the SiPM file is decoded directly in DAQ order into the merged file
+    DaqTree = RootifyDaq(inputDaqFileName)
+    if DaqTree is None:
+        return False
+
+    print ('Running fused data conversion and alignment (binary to SiPM) on ' + inputSiPMFileName)
+    SiPMDecoder = SiPMConvert.makeDecoder(inputSiPMFileName)
+    if SiPMDecoder is None:
+        return False
+
+    retval = CreateBlendedFileFused(SiPMDecoder,DaqTree,outfilename)
+
+    if os.path.isfile("temp.root"):
+        os.remove("temp.root")
+
+    return retval
+
+def RootifyDaq(inputDaqFileName):
+    # creating temporary ntuples Tree from DAQ txt file. Returns the CERNSPS2025 tree, None in case of problems
+    global DaqRootifier
+    f = None 
+    try: 
+        if daqWorkers > 1:
+            f = DRbz2blocks.Bz2BlockReader(inputDaqFileName,daqWorkers)
+        else:
+            f = bz2.open(inputDaqFileName,'rt')
+    except: 
+        print ('ERROR! File ' + inputDaqFileName + ' not found')
+        return None
+
+    DaqRootifier = DRrootify.DRrootify()
+    DaqRootifier.drf = f
+
+    #### rootify the input data
+
+    if not DaqRootifier.ReadandRoot():
+        print("Cannot rootify file " + inputDaqFileName)
+        return None
+    return DaqRootifier.tbtree
     
 
 def GetNewRuns():
@@ -378,9 +360,23 @@ def main():
     parser.add_argument('--newFiles',dest='newFiles',action='store_true', default=False, help='Looks for new runs in ' + SiPMFileDir + ' and ' + DaqFileDir + ', and merges them. To be used ONLY from the ideadr account on lxplus')
     parser.add_argument("--newRunsList",dest='newRunsList',action='store_true', default=False, help='Only produce a list of new runs to be processed in runs.list') 
     
+    parser.add_argument('--offsetMin',dest='offsetMin',type=int,default=-4, help='Smallest SiPM/DAQ offset tried')
+    parser.add_argument('--offsetMax',dest='offsetMax',type=int,default=4, help='Largest SiPM/DAQ offset tried')
+    parser.add_argument('--perSpillOffset',dest='perSpillOffset',action='store_true', default=False, help='Determine the SiPM/DAQ offset spill by spill, to follow offset changes within a run')
+    parser.add_argument('--fused',dest='fused',action='store_true', default=False, help='Decode the SiPM file directly into the aligned tree of the merged file, without the intermediate SiPM root file')
+    parser.add_argument('-j', '--daqWorkers',dest='daqWorkers',default=1,type=int,help='Number of processes decompressing and decoding the bz2 PMT DAQ file, block by block')
+    
     par  = parser.parse_args()
     global doNotMerge
     doNotMerge = par.no_merge
+    global fusedPipeline
+    fusedPipeline = par.fused
+    global offsetRange
+    offsetRange = (par.offsetMin, par.offsetMax)
+    global perSpillOffset
+    perSpillOffset = par.perSpillOffset
+    global daqWorkers
+    daqWorkers = par.daqWorkers
 
     if par.newRunsList:
         file_list = open('runs.list','w')
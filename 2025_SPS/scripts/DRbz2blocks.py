@@ -0,0 +1,174 @@
+#!/usr/bin/env python3
+
+##**************************************************
+## \file DRbz2blocks.py
+## \brief: parallel reading of the bz2 PMT DAQ files.
+##         bzip2 compresses the text in independent blocks (900 kB each
+##         with the default -9). The blocks are located in the compressed
+##         file, each one is rewrapped as a single-block bz2 stream, and a
+##         pool of worker processes decompresses it and decodes its lines
+##         with DREvent.DRdecode. The decoded events are given back in
+##         file order, one per line as when reading with bz2.open.
+##**************************************************
+
+import DREvent
+import bz2
+import concurrent.futures
+import locale
+import collections
+
+BLOCK_MAGIC = bytes.fromhex('314159265359') # start of a compressed block
+EOS_MAGIC = bytes.fromhex('177245385090') # end of a bz2 stream
+MAGIC_BITS = 48
+WINDOW_SIZE = 4*1024*1024 # bytes of compressed file read at a time
+
+# what DRrootify uses of a DREvent, cheap to send back from the workers
+DecodedEvent = collections.namedtuple('DecodedEvent', ['EventNumber', 'SpillNumber', 'EventTime', 'TriggerMask', 'ADCs', 'TDCs'])
+
+class Bz2BlockError(Exception):
+    '''The file cannot be read block by block: read it sequentially instead'''
+    pass
+
+def FindMarkers(data, firstBit):
+    '''Bit positions in data, from firstBit on, of the block and end of stream magics, as (bit, isEnd) sorted by bit'''
+    value = int.from_bytes(data, 'big')
+    lastBit = 8*len(data) - MAGIC_BITS
+    markers = []
+    for shift in range(8):
+        # data shifted left by shift bits, behind an extra byte: the bits at shift modulo 8 are byte aligned
+        shifted = (value << shift).to_bytes(len(data) + 1, 'big')
+        for magic, isEnd in ((BLOCK_MAGIC, False), (EOS_MAGIC, True)):
+            pos = shifted.find(magic)
+            while pos >= 0:
+                bit = 8*pos - 8 + shift
+                if bit >= firstBit and bit <= lastBit:
+                    markers.append((bit, isEnd))
+                pos = shifted.find(magic, pos + 1)
+    markers.sort()
+    return markers
+
+def Rewrap(data, firstBit, endBit, level):
+    '''The block in bits [firstBit, endBit) of data as a bz2 stream of its own'''
+    nBits = endBit - firstBit
+    chunk = data[firstBit//8:(endBit + 7)//8]
+    block = (int.from_bytes(chunk, 'big') >> (8*len(chunk) - (endBit - 8*(firstBit//8)))) & ((1 << nBits) - 1)
+    crc = (block >> (nBits - MAGIC_BITS - 32)) & 0xffffffff
+    # for a stream of one block the combined CRC is the block CRC
+    stream = (((block << MAGIC_BITS) | int.from_bytes(EOS_MAGIC, 'big')) << 32) | crc
+    nBits += MAGIC_BITS + 32
+    padding = (8 - nBits%8)%8
+    return b'BZh' + level + (stream << padding).to_bytes((nBits + padding)//8, 'big')
+
+def DecodeLine(line):
+    '''DREvent.DRdecode of a line, as a DecodedEvent'''
+    if line.endswith('\r\n'):
+        line = line[:-2] + '\n'
+    evt = DREvent.DRdecode(line)
+    if evt == None:
+        return None
+    return DecodedEvent(evt.EventNumber, evt.SpillNumber, evt.EventTime, evt.TriggerMask, dict(evt.ADCs), dict(evt.TDCs))
+
+def DecodeBlock(stream):
+    '''Run by the workers: decompresses one block, returns the bytes before its first newline (included), the decoded
+    events of its complete lines and the bytes after its last newline. None if the block cannot be decompressed'''
+    try:
+        text = bz2.decompress(stream)
+    except (OSError, ValueError, EOFError):
+        return None
+    first = text.find(b'\n')
+    if first < 0:
+        return (None, [], text)
+    last = text.rfind(b'\n')
+    encoding = locale.getpreferredencoding(False) # as bz2.open in text mode
+    events = []
+    if last > first:
+        events = [DecodeLine(line.decode(encoding) + '\n') for line in text[first + 1:last].split(b'\n')]
+    return (text[:first + 1], events, text[last + 1:])
+
+class Bz2BlockReader:
+    '''Reads a bz2 DAQ file with nWorkers processes, block by block'''
+
+    def __init__(self, fname, nWorkers = 2):
+        '''Class Constructor'''
+        self.fname = fname
+        self.nWorkers = max(nWorkers, 1)
+        self.file = open(fname, 'rb')
+
+    def Blocks(self):
+        '''The blocks of the file, rewrapped as bz2 streams, in file order'''
+        data = b''
+        base = 0 # file offset of data[0]
+        scanned = 0 # bit of the file from which the magics have not been looked for yet
+        streamStart = 0 # bit where the next stream header is expected
+        blockStart = None # bit of the magic of the current block
+        level = b''
+        endOfFile = False
+        while not endOfFile:
+            chunk = self.file.read(WINDOW_SIZE)
+            endOfFile = len(chunk) == 0
+            data += chunk
+            scanFrom = scanned//8 - base
+            for bit, isEnd in FindMarkers(data[scanFrom:], scanned - 8*(base + scanFrom)):
+                bit += 8*(base + scanFrom)
+                if blockStart == None:
+                    # a new stream: header, then its first block (or the end of an empty stream) right after it
+                    if bit < streamStart + 32:
+                        continue # inside the padding or the CRC of the previous stream
+                    header = data[streamStart//8 - base:streamStart//8 - base + 4]
+                    if bit != streamStart + 32 or header[:3] != b'BZh' or header[3:] < b'1' or header[3:] > b'9':
+                        raise Bz2BlockError('no bz2 stream header at byte ' + str(streamStart//8))
+                    level = header[3:]
+                    if isEnd:
+                        streamStart = (bit + MAGIC_BITS + 32 + 7)//8*8
+                    else:
+                        blockStart = bit
+                    continue
+                yield Rewrap(data, blockStart - 8*base, bit - 8*base, level)
+                if isEnd:
+                    streamStart = (bit + MAGIC_BITS + 32 + 7)//8*8
+                    blockStart = None
+                else:
+                    blockStart = bit
+            scanned = max(scanned, 8*(base + len(data)) - MAGIC_BITS + 1)
+            keep = min(scanned//8, (blockStart if blockStart != None else streamStart)//8, base + len(data))
+            data = data[keep - base:]
+            base = keep
+        if blockStart != None:
+            raise Bz2BlockError('the last bz2 stream is not complete')
+        # anything after the last stream is ignored, as bz2.open does
+        if streamStart == 0:
+            raise Bz2BlockError('no bz2 stream found')
+
+    def Events(self):
+        '''The DREvent.DRdecode events of the lines of the file, in order (None for the lines to skip)'''
+        with concurrent.futures.ProcessPoolExecutor(max_workers = self.nWorkers) as pool:
+            pending = []
+            line = b''
+            blocks = self.Blocks()
+            moreBlocks = True
+            encoding = locale.getpreferredencoding(False)
+            while moreBlocks or len(pending) > 0:
+                # at most two blocks per worker in flight, to bound the memory used
+                while moreBlocks and len(pending) < 2*self.nWorkers:
+                    try:
+                        pending.append(pool.submit(DecodeBlock, next(blocks)))
+                    except StopIteration:
+                        moreBlocks = False
+                if len(pending) == 0:
+                    break
+                decoded = pending.pop(0).result()
+                if decoded == None:
+                    raise Bz2BlockError('a block of ' + self.fname + ' cannot be decompressed')
+                head, events, tail = decoded
+                if head != None:
+                    # the line that started in the previous blocks ends here
+                    yield DecodeLine((line + head).decode(encoding))
+                    line = b''
+                for evt in events:
+                    yield evt
+                line += tail
+            if len(line) > 0:
+                yield DecodeLine(line.decode(encoding))
+
+    def close(self):
+        self.file.close()
@@ -14,11 +14,13 @@
 ##**************************************************
 
 import DREvent
+import DRbz2blocks
 import ROOT 
 from array import array
 import sys
 import glob
 import os
+import bz2
 
 class DRrootify:
     '''Class to rootify raw ASCII files'''
@@ -50,16 +52,33 @@ class DRrootify:
         self.tbtree.Branch("TDCsval",self.TDCsval,'TDCsval[48]/I')
         self.tbtree.Branch("TDCscheck",self.TDCscheck,'TDCscheck[48]/I')
 
+    def Events(self):
+        '''Decoded events of the input, one per line (None for the lines to skip)'''
+        if isinstance(self.drf, DRbz2blocks.Bz2BlockReader):
+            return self.drf.Events()
+        return (DREvent.DRdecode(line) for line in self.drf)
+
     def ReadandRoot(self):
         if self.drf == None:
             print('Input file not opened')
             return False
 
+        if isinstance(self.drf, DRbz2blocks.Bz2BlockReader):
+            try:
+                return self.Fill()
+            except DRbz2blocks.Bz2BlockError as e:
+                print("Cannot read " + self.drf.fname + " block by block (" + str(e) + "), reading it sequentially")
+                self.tbtree.Reset()
+                self.drf.close()
+                self.drf = bz2.open(self.drf.fname,'rt')
+        return self.Fill()
+
+    def Fill(self):
         thisPhysicsEvents = 0
         thisPedestalEvents = 0
         CurrentSpillNumber = 0 #spill number will start from 0
         NumOfEventsInSpill = 0
-        for i,line in enumerate(self.drf):
+        for i,evt in enumerate(self.Events()):
             
             if i%500 == 0 : print( "------>At line "+str(i))
             for ch in range(0,224):
@@ -67,7 +86,6 @@ class DRrootify:
                 self.TDCscheck[ch] = -1
             for ch in range(0,224):
                 self.ADCs[ch] = -1
-            evt = DREvent.DRdecode(line)
             if evt==None: #skip this event
                 continue
             if evt.TriggerMask == 1:
@@ -105,8 +123,13 @@ class DRrootify:
         self.tbtree.Write()
         self.drffile.Close()
 
-    def Open(self,fname):
-        self.drf = open(fname,'r')
+    def Open(self,fname,nWorkers = 1):
+        if not fname.endswith('.bz2'):
+            self.drf = open(fname,'r')
+        elif nWorkers > 1:
+            self.drf = DRbz2blocks.Bz2BlockReader(fname,nWorkers)
+        else:
+            self.drf = bz2.open(fname,'rt')
 
 
 def main():
@@ -123,6 +146,9 @@ def main():
     parser.add_argument('-i','--input_file', action='store', dest='inputfile',
                         default='',
                         help='input file')
+    parser.add_argument('-j','--nWorkers', action='store', dest='nWorkers', type=int,
+                        default=1,
+                        help='Number of processes decompressing and decoding a bz2 input file, block by block')
     par = parser.parse_args()
    
     infile = par.inputfile
@@ -132,7 +158,7 @@ def main():
     print("Going to rootify "+infile+" in "+outfile)
 
     dr=DRrootify(outfile)
-    dr.Open(infile)
+    dr.Open(infile,par.nWorkers)
     if not dr.ReadandRoot():
         print ("Problems in rootifying ") 
     dr.Write()
@@ -6,6 +6,7 @@ import argparse
 import re
 import ROOT
 import json 
+import math
 
 
 def fill_array(arr, values):
@@ -57,12 +58,31 @@ def main():
                         default=os.getenv('IDEARepo') + '/2025_SPS/MapAndCalibration/SiPM_ADCtoGeV_v1.json',
                         help='SiPM constant for computing the SiPM energy in GeV from the unified ADC signal')
     
+    parser.add_argument('--dualReadout', action='store_true', dest='dualReadout',
+                        default=False,
+                        help='Adds the dual-readout energies to the ntuple, with chi from the calibration file (-c): "Calibrations": {"DR": {"chiPMT": [chi], "chiSiPM": [chi]}}. The energy of a section without chi is NaN')
+    parser.add_argument('--fitChi', action='store_true', dest='fitChi',
+                        default=False,
+                        help='Adds the dual-readout energies to the ntuple, with chi fitted on the run ((1 - S/E) vs (1 - C/E), needs --beamEnergy). Falls back to the values of the calibration file if the fit fails')
+    parser.add_argument('--fitChiEntries', action='store', dest='fitChiEntries', type=int,
+                        default=100000,
+                        help='Number of entries used to fit chi (all if negative)')
+    parser.add_argument('--beamEnergy', action='store', dest='beamEnergy', type=float,
+                        default=0.,
+                        help='Beam energy in GeV, for --fitChi')
+    parser.add_argument('--chiSelection', action='store', dest='chiSelection',
+                        default='',
+                        help='Event selection of --fitChi as JSON, with the fields of DRChiFitSelection (PhysicsHelper.h), e.g. \'{"maxPShower": 50, "maxMCounter": 30}\'')
+    
     parser.add_argument('--doCalibration', action='store_true', dest='doCalibration', 
                         default=True,
                         help='If specified, do calibration using pedestals from the json calibration file')
     parser.add_argument('--useLocalPedestals', action='store_true', dest='useLocalPedestals',
                         default=True,
                         help='If specified, compute pedestals from TriggerMask==2 (see code for details)')
+    parser.add_argument('--pedestalWindow', action='store', dest='pedestalWindow', type=int,
+                        default=0,
+                        help='If positive, the PMT and aux pedestals are computed in windows of this number of events, to follow drifts within the run')
     parser.add_argument('-o','--output_dir', action='store', dest='ntuplepath',
                         default='/eos/user/i/ideadr/TB2025_H8/physicsNtuples/',
                         help='output root file path.')
@@ -75,6 +95,15 @@ def main():
     parser.add_argument('-r','--run_number', action='store', dest='runNumber',
                         default='-1000',
                         help='If different from -1000, causes the script to run only on the indicated run number.')
+    parser.add_argument('--rntuple', action='store_true', dest='rntuple',
+                        default=False,
+                        help='Write the Phys2025 ntuple as an RNTuple instead of a TTree')
+    parser.add_argument('--imt', action='store', dest='imt', type=int,
+                        default=-1,
+                        help='If not negative, enables ROOT implicit multithreading with this number of threads (0: all cores), e.g. to compress the RNTuple pages in parallel')
+    parser.add_argument('-j','--nThreads', action='store', dest='nThreads', type=int,
+                        default=1,
+                        help='Number of threads calibrating the events: the entries are split in batches, written in the original order')
     par = parser.parse_args()
 
 
@@ -122,6 +151,12 @@ def main():
     except:
         print('\n\nProblem loading the SiPM calibration files.\n\n')
         return -1
+
+    DRChiSelection = json.loads(par.chiSelection) if par.chiSelection else {}
+
+    if par.fitChi and par.beamEnergy <= 0:
+        print('\n\n--fitChi needs the beam energy (--beamEnergy). Exiting.\n\n')
+        return -1
         
     
     if os.path.isfile(par.dwccalibrationfile):
@@ -163,6 +198,9 @@ def main():
     #    ROOT.gROOT.LoadMacro(macroPath+"PhysicsHelper.cxx+")
     ROOT.gSystem.Load("libPhysicsHelper")
 
+    if par.imt >= 0:
+        ROOT.EnableImplicitMT(par.imt)
+
     for fl in mrgfls:
         print("\n\nRunning on run " + str(fl) + '\n\n')
         #print(par.rawdatapath)
@@ -184,11 +222,23 @@ def main():
         outfile = ROOT.TFile(outfilename,"recreate")
         outfile.cd()
         outtree_metadata = intree_metadata.CloneTree(-1)
-        outtree_physics = ROOT.TTree("Phys2025","Tree with merged and calibrated info from TB2025")
+        if par.rntuple:
+            outtree_physics = ROOT.nullptr
+        else:
+            outtree_physics = ROOT.TTree("Phys2025","Tree with merged and calibrated info from TB2025")
 
         physHelp = ROOT.PhysicsHelper(int(fl),outtree_physics,intree_PMT,intree_SiPM)
+        if par.rntuple and not physHelp.SetRNTupleOutput(outfile):
+            print("\033[31mCannot write the physics ntuple as RNTuple\033[0m")
+            return -1
+        doDualReadout = par.dualReadout or par.fitChi
+        physHelp.EnableDualReadout(doDualReadout)
         physHelp.PrepareForRun()
-        if physHelp.DeterminePMTAuxPedestals() is False:
+        pedOption = 0
+        if par.pedestalWindow > 0:
+            physHelp.SetPedestalWindow(par.pedestalWindow)
+            pedOption = 1
+        if physHelp.DeterminePMTAuxPedestals(pedOption) is False:
             print("\033[31mProblems computing the PMT and AUX detectors pedestals\033[0m")
 
         # Get the necessary input values for the PMT calibration
@@ -235,11 +285,37 @@ def main():
 
 
 
+        # chi of the dual-readout energies, from the calibration file and/or fitted on the run
+
+        if doDualReadout:
+            DRCal = physHelp.GetDRCalibration()
+            if DWCCalibrationData != None and "DR" in DWCCalibrationData["Calibrations"]:
+                dr = DWCCalibrationData["Calibrations"]["DR"]
+                if len(dr.get("chiPMT", [])) > 0:
+                    DRCal.chiPMT = dr["chiPMT"][0]
+                if len(dr.get("chiSiPM", [])) > 0:
+                    DRCal.chiSiPM = dr["chiSiPM"][0]
+            if par.fitChi:
+                DRFit = physHelp.GetDRChiFitSelection()
+                DRFit.beamEnergy = par.beamEnergy
+                for cut, value in DRChiSelection.items():
+                    setattr(DRFit, cut, value)
+                if physHelp.FitDualReadoutChi(par.fitChiEntries) is False:
+                    print("\033[33mchi could not be fitted for every section, using the values from the calibration file\033[0m")
+            print("Dual-readout chi: PMT " + str(DRCal.chiPMT) + ", SiPM " + str(DRCal.chiSiPM))
+            for section, chi in (("PMT", DRCal.chiPMT), ("SiPM", DRCal.chiSiPM)):
+                if math.isnan(chi):
+                    print("\033[31mNo chi for the " + section + " section: tot" + section + "DRene is NaN in this run\033[0m")
+
         #PMTCal.Print()
+        physHelp.SetNThreads(par.nThreads)
         physHelp.Loop()
 
         outtree_metadata.Write()
-        outtree_physics.Write("",ROOT.TObject.kOverwrite)
+        if par.rntuple:
+            physHelp.CommitOutput()
+        else:
+            outtree_physics.Write("",ROOT.TObject.kOverwrite)
         outfile.Close()
 
         shutil.move(outfilename,par.ntuplepath + '/' + outfilename)
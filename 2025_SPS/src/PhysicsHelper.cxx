@@ -1,20 +1,167 @@
 #include "PhysicsHelper.h"
 #include "mappingPMT.hpp"
+#include "mapping_sipm.hpp"
 
 // ROOT includes
 
+#include <TBranch.h>
 #include <TString.h>
+#include <TFile.h>
+#include <TROOT.h>
+
+#ifdef PHYSICSHELPER_HAS_RNTUPLE
+#include <ROOT/RField.hxx>
+#include <ROOT/RNTupleModel.hxx>
+#include <ROOT/RNTupleWriter.hxx>
+#include <ROOT/RNTupleWriteOptions.hxx>
+#endif
 
 // std library includes
 
 #include <algorithm>
 #include <numeric>
+#include <atomic>
 #include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
 #include <fstream>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace {
+
+  // Entries calibrated by a worker in one go, and batches a worker can have ready before they are written
+  constexpr Long64_t BATCH_SIZE = 1000;
+  constexpr std::size_t MAX_READY_BATCHES = 2;
+
+  // Range of the ADC values histogrammed for the pedestals (12 bit ADC, -1 if not read out).
+  // Values outside are counted in the first or last bin
+  constexpr Int_t PED_ADC_MIN = -1;
+  constexpr Int_t PED_ADC_MAX = 4095;
+  constexpr Int_t PED_ADC_NBINS = PED_ADC_MAX - PED_ADC_MIN + 1;
+  // Pedestal events needed in a window for local pedestals
+  constexpr Long64_t MIN_LOCAL_PEDESTALS = 50;
+  // Events needed to fit chi
+  constexpr Long64_t MIN_CHI_FIT_EVENTS = 100;
+
+  // Histogram of the ADC values of every channel, with one bin per ADC count: the quantiles are exact,
+  // and the memory does not depend on the number of events
+  class ADCHistograms
+  {
+  public:
+    ADCHistograms() : m_counts(N_PHELP_ADC * PED_ADC_NBINS, 0), m_n(0), m_nOutside(0) {}
+    void Fill(const std::array<Int_t,N_PHELP_ADC> & l_adcs)
+    {
+      for (unsigned int ch = 0; ch < N_PHELP_ADC; ++ch){
+	Int_t l_bin = l_adcs[ch] - PED_ADC_MIN;
+	if (l_bin < 0 || l_bin >= PED_ADC_NBINS){
+	  l_bin = (l_bin < 0) ? 0 : PED_ADC_NBINS - 1;
+	  ++m_nOutside;
+	}
+	++m_counts[ch * PED_ADC_NBINS + l_bin];
+      }
+      ++m_n;
+    }
+    // Value of rank l_rank (from 0) of channel ch: the element std::nth_element would put there
+    Float_t Quantile(unsigned int ch, Long64_t l_rank) const
+    {
+      const UInt_t * l_counts = m_counts.data() + ch * PED_ADC_NBINS;
+      Long64_t l_sum = 0;
+      for (Int_t l_bin = 0; l_bin < PED_ADC_NBINS; ++l_bin){
+	l_sum += l_counts[l_bin];
+	if (l_sum > l_rank) return Float_t(l_bin + PED_ADC_MIN);
+      }
+      return Float_t(PED_ADC_MAX);
+    }
+    Float_t Median(unsigned int ch) const {return Quantile(ch, m_n/2);}
+    Float_t IQR(unsigned int ch) const {return Quantile(ch, (3*m_n)/4) - Quantile(ch, m_n/4);}
+    void Clear()
+    {
+      std::fill(m_counts.begin(), m_counts.end(), 0);
+      m_n = 0;
+    }
+    Long64_t GetN() const {return m_n;}
+    Long64_t GetNOutside() const {return m_nOutside;}
+  private:
+    std::vector<UInt_t> m_counts;
+    Long64_t m_n;
+    Long64_t m_nOutside;
+  };
+
+  // Partial sums of the derived quantities, one per lane: a lane adds every MOMENT_LANES-th channel, so that the
+  // loops over the channels are vectorised without reordering the additions of any sum (no -ffast-math needed)
+  constexpr unsigned int MOMENT_LANES = 16;
+  struct MomentLanes
+  {
+    // [0] S, [1] C. Energy of all the deposits, and weight (positive energy) with its first and second moments
+    alignas(64) Float_t e[2][MOMENT_LANES];
+    alignas(64) Float_t w[2][MOMENT_LANES];
+    alignas(64) Float_t wx[2][MOMENT_LANES];
+    alignas(64) Float_t wy[2][MOMENT_LANES];
+    alignas(64) Float_t wxx[2][MOMENT_LANES];
+    alignas(64) Float_t wyy[2][MOMENT_LANES];
+
+    MomentLanes() {std::memset(this, 0, sizeof(MomentLanes));}
+
+    // Adds the n channels with energy l_e, position (l_x, l_y) and type l_isS (1 for S, 0 for C).
+    // The energy sums go to l_sums (which can be this->e), the moments to this
+    void Add(const Float_t * __restrict l_e, const Float_t * __restrict l_x, const Float_t * __restrict l_y,
+	     const Float_t * __restrict l_isS, unsigned int n, Float_t (&l_sums)[2][MOMENT_LANES])
+    {
+      unsigned int i = 0;
+      for (; i + MOMENT_LANES <= n; i += MOMENT_LANES){
+	for (unsigned int k = 0; k < MOMENT_LANES; ++k) Accumulate(k, l_e[i+k], l_x[i+k], l_y[i+k], l_isS[i+k], l_sums);
+      }
+      for (; i < n; ++i) Accumulate(i % MOMENT_LANES, l_e[i], l_x[i], l_y[i], l_isS[i], l_sums);
+    }
+    void Accumulate(unsigned int k, Float_t l_e, Float_t l_x, Float_t l_y, Float_t l_isS, Float_t (&l_sums)[2][MOMENT_LANES])
+    {
+      const Float_t l_w = std::max(l_e, 0.f);
+      const Float_t l_isC = 1.f - l_isS;
+      l_sums[0][k] += l_isS * l_e;
+      l_sums[1][k] += l_isC * l_e;
+      w[0][k] += l_isS * l_w;
+      w[1][k] += l_isC * l_w;
+      wx[0][k] += l_isS * l_w * l_x;
+      wx[1][k] += l_isC * l_w * l_x;
+      wy[0][k] += l_isS * l_w * l_y;
+      wy[1][k] += l_isC * l_w * l_y;
+      wxx[0][k] += l_isS * l_w * l_x * l_x;
+      wxx[1][k] += l_isC * l_w * l_x * l_x;
+      wyy[0][k] += l_isS * l_w * l_y * l_y;
+      wyy[1][k] += l_isC * l_w * l_y * l_y;
+    }
+
+    static double Sum(const Float_t (&l_lanes)[MOMENT_LANES])
+    {
+      return std::accumulate(l_lanes, l_lanes + MOMENT_LANES, 0.);
+    }
+    // Barycentre and RMS width of type t
+    void Shower(unsigned int t, Float_t & l_X, Float_t & l_Y, Float_t & l_RMSX, Float_t & l_RMSY) const
+    {
+      const double l_w = Sum(w[t]);
+      if (l_w <= 0){
+	l_X = l_Y = 0.;
+	l_RMSX = l_RMSY = -1.;
+	return;
+      }
+      const double l_meanX = Sum(wx[t]) / l_w;
+      const double l_meanY = Sum(wy[t]) / l_w;
+      l_X = l_meanX;
+      l_Y = l_meanY;
+      l_RMSX = std::sqrt(std::max(Sum(wxx[t]) / l_w - l_meanX * l_meanX, 0.));
+      l_RMSY = std::sqrt(std::max(Sum(wyy[t]) / l_w - l_meanY * l_meanY, 0.));
+    }
+  };
+
+}
 
 
-PMTAuxCalibration::PMTAuxCalibration()
+PMTAuxCalibration::PMTAuxCalibration():
+  m_version(0)
 {
   std::fill(m_ADCs_ped, m_ADCs_ped + N_PHELP_PMT, 0.);
   std::fill(m_ADCtoGeV, m_ADCtoGeV + N_PHELP_PMT, 1.);
@@ -33,7 +180,10 @@ void PMTAuxCalibration::Print()
 
 void PMTAuxCalibration::FillPMTPed(unsigned int idx, Float_t val)
 {
-  if (idx < N_PHELP_PMT) m_ADCs_ped[idx] = val;
+  if (idx < N_PHELP_PMT){
+    m_ADCs_ped[idx] = val;
+    ++m_version;
+  }
   else std::cerr << "PmtAuxCalibration::FillPed: requested to fill pedestal for channel " << idx << " but there are only " << N_PHELP_PMT << " channels. Doing nothing." << std::endl;
 }
 
@@ -43,7 +193,10 @@ void PMTAuxCalibration::FillADCtoGeV(TString ch_name, Float_t val)
 
 void PMTAuxCalibration::FillADCtoGeV(unsigned int idx, Float_t val)
 {
-  if (idx < N_PHELP_PMT) m_ADCtoGeV[idx] = val;
+  if (idx < N_PHELP_PMT){
+    m_ADCtoGeV[idx] = val;
+    ++m_version;
+  }
   else std::cerr << "PmtAuxCalibration::FillADCtoGeV: requested to fill calibration constant for channel " << idx << " but there are only " << N_PHELP_PMT	<< " channels. Doing nothing." << std::endl;
 }
 
@@ -76,22 +229,126 @@ SiPMCalibration::SiPMCalibration()
   }
 }
 
+void SiPMCalibration::CalibrateBoard(unsigned int board, const Short_t * HG, const Short_t * LG, Float_t * energy) const
+{
+  const unsigned int l_first = board * N_PHELP_SIPM_PER_BOARD;
+  const Float_t * __restrict l_pedHG = m_ADCPedHG + l_first;
+  const Float_t * __restrict l_pedLG = m_ADCPedLG + l_first;
+  const Float_t * __restrict l_q = m_HGfromLG_q + l_first;
+  const Float_t * __restrict l_m = m_HGfromLG_m + l_first;
+  const Float_t * __restrict l_toGeV = m_ADCtoGeV + l_first;
+  const Short_t * __restrict l_HG = HG;
+  const Short_t * __restrict l_LG = LG;
+  Float_t * __restrict l_energy = energy;
+
+  // Both the HG and the HG-from-LG values are computed for all the channels, then one of them is selected.
+  // With no branch on the data both loops are vectorised (in a single loop the compiler keeps the branch)
+  alignas(64) float l_fromHG[N_PHELP_SIPM_PER_BOARD];
+  alignas(64) float l_fromLG[N_PHELP_SIPM_PER_BOARD];
+  for (unsigned int i = 0; i < N_PHELP_SIPM_PER_BOARD; ++i){
+    l_fromHG[i] = float(l_HG[i]) - l_pedHG[i];
+    l_fromLG[i] = l_m[i] * (float(l_LG[i]) - l_pedLG[i]) + l_q[i];
+  }
+  for (unsigned int i = 0; i < N_PHELP_SIPM_PER_BOARD; ++i){
+    l_energy[i] = l_toGeV[i] * (l_HG[i] > HG_SATURATION ? l_fromLG[i] : l_fromHG[i]);
+  }
+}
+
+#ifdef PHYSICSHELPER_HAS_RNTUPLE
+// The fields read from the same members as the TTree branches
+struct PhysicsHelper::NTupleSink
+{
+  std::unique_ptr<ROOT::RNTupleModel> model = ROOT::RNTupleModel::CreateBare();
+  std::vector<std::pair<std::string, void *>> addresses;
+  std::unique_ptr<ROOT::RNTupleWriter> writer;
+  std::unique_ptr<ROOT::REntry> entry;
+
+  template <class T> void Add(const char * name, T * address)
+  {
+    model->AddField(std::make_unique<ROOT::RField<T>>(name));
+    addresses.emplace_back(name, address);
+  }
+  void Open(const std::string & name, TFile & file)
+  {
+    ROOT::RNTupleWriteOptions options;
+    options.SetCompression(file.GetCompressionSettings());
+    options.SetUseImplicitMT(ROOT::RNTupleWriteOptions::EImplicitMT::kDefault); // parallel page compression if IMT is on
+    writer = ROOT::RNTupleWriter::Append(std::move(model), name, file, options);
+    entry = writer->CreateEntry();
+    for (auto & l_address : addresses) entry->BindRawPtr(l_address.first, l_address.second);
+  }
+  void Fill() {writer->Fill(*entry);}
+};
+#else
+struct PhysicsHelper::NTupleSink
+{
+  template <class T> void Add(const char *, T *) {}
+  void Open(const std::string &, TFile &) {}
+  void Fill() {}
+};
+#endif
+
 PhysicsHelper::PhysicsHelper(unsigned int runnumber, TTree * newtree, TTree * PMTTree, TTree * SiPMTree):
   m_runnumber(runnumber),
+  m_ntuple(nullptr),
+  m_ntupleFile(nullptr),
+  m_recordSize(0),
+  m_nThreads(1),
   m_newTree(newtree),
   m_PMTTree(PMTTree),
-  m_SiPMTree(SiPMTree)
+  m_SiPMTree(SiPMTree),
+  m_pedWindow(20000),
+  m_currentPedWindow(-1),
+  m_planVersion(0),
+  m_doDualReadout(false)
 {
 }
 
 PhysicsHelper::~PhysicsHelper()
 {
+  delete m_ntuple;
+}
+
+bool PhysicsHelper::SetRNTupleOutput(TFile * outfile, std::string name)
+{
+#ifndef PHYSICSHELPER_HAS_RNTUPLE
+  std::cerr << "PhysicsHelper::SetRNTupleOutput: this library was built without RNTuple support" << std::endl;
+  return false;
+#endif
+  if (!outfile || !outfile->IsWritable()){
+    std::cerr << "PhysicsHelper::SetRNTupleOutput: the output file is not writable" << std::endl;
+    return false;
+  }
+  delete m_ntuple;
+  m_ntuple = new NTupleSink();
+  m_ntupleFile = outfile;
+  m_ntupleName = name;
+  return true;
+}
+
+void PhysicsHelper::CommitOutput()
+{
+  // The writer commits the RNTuple to the file when it goes away
+  delete m_ntuple;
+  m_ntuple = nullptr;
+}
+
+template <class T>
+void PhysicsHelper::BookField(const char * name, T * address)
+{
+  if (m_ntuple) m_ntuple->Add(name, address);
+  else if (m_newTree) m_newTree->Branch(name, address);
+  m_outputFields.emplace_back(address, sizeof(T));
+  m_recordSize += sizeof(T);
 }
 
 bool PhysicsHelper::PrepareForRun()
 {
   TString tmp_str;
 
+  m_outputFields.clear();
+  m_recordSize = 0;
+
   m_PMTTree->SetBranchAddress("EventNumber", &m_eventNumber);
   m_PMTTree->SetBranchAddress("TriggerMask", &m_triggerMask);
   m_PMTTree->SetBranchAddress("TDCsval", &m_TDCsval);
@@ -101,40 +358,75 @@ bool PhysicsHelper::PrepareForRun()
   m_SiPMTree->SetBranchAddress("SiPM_HG", &m_SiPM_HG);
   m_SiPMTree->SetBranchAddress("SiPM_LG", &m_SiPM_LG);
 
-  m_newTree->Branch("PMT", &m_PMT);
-  m_newTree->Branch("SiPM", &m_SiPM);
-  m_newTree->Branch("BoardTimeStamps", &m_BoardTimeStamps);
-  m_newTree->Branch("SIPM_HG",&m_SiPM_HG);
-  m_newTree->Branch("SIPM_LG",&m_SiPM_LG);
-  m_newTree->Branch("TDCsval",&m_TDCsval);
-  m_newTree->Branch("ADCs",&m_ADCs);
-  m_newTree->Branch("EventNumber",&m_eventNumber);
-  m_newTree->Branch("TriggerMask",&m_triggerMask);
-
-  m_newTree->Branch("L02", &L02);
-  m_newTree->Branch("L03", &L03);
-  m_newTree->Branch("L04", &L04);
-  m_newTree->Branch("L05", &L05);
-  m_newTree->Branch("L07", &L07);
-  m_newTree->Branch("L08", &L08);
-  m_newTree->Branch("L09", &L09);
-  m_newTree->Branch("L10", &L10);
-  m_newTree->Branch("XDWC1", &XDWC1);
-  m_newTree->Branch("XDWC2", &XDWC2);
-  m_newTree->Branch("YDWC1", &YDWC1);
-  m_newTree->Branch("YDWC2", &YDWC2);
-  m_newTree->Branch("Veto", &Veto);
-  m_newTree->Branch("PShower", &PShower);
-  m_newTree->Branch("MCounter", &MCounter);
-  m_newTree->Branch("C1", &C1);
-  m_newTree->Branch("C2", &C2);
-  m_newTree->Branch("C3", &C3);
-  m_newTree->Branch("TailC", &TailC);
+  BookField("PMT", &m_PMT);
+  BookField("SiPM", &m_SiPM);
+  BookField("BoardTimeStamps", &m_BoardTimeStamps);
+  BookField("SIPM_HG",&m_SiPM_HG);
+  BookField("SIPM_LG",&m_SiPM_LG);
+  BookField("TDCsval",&m_TDCsval);
+  BookField("ADCs",&m_ADCs);
+  BookField("EventNumber",&m_eventNumber);
+  BookField("TriggerMask",&m_triggerMask);
+
+  BookField("L02", &L02);
+  BookField("L03", &L03);
+  BookField("L04", &L04);
+  BookField("L05", &L05);
+  BookField("L07", &L07);
+  BookField("L08", &L08);
+  BookField("L09", &L09);
+  BookField("L10", &L10);
+  BookField("XDWC1", &XDWC1);
+  BookField("XDWC2", &XDWC2);
+  BookField("YDWC1", &YDWC1);
+  BookField("YDWC2", &YDWC2);
+  BookField("Veto", &Veto);
+  BookField("PShower", &PShower);
+  BookField("MCounter", &MCounter);
+  BookField("C1", &C1);
+  BookField("C2", &C2);
+  BookField("C3", &C3);
+  BookField("TailC", &TailC);
+
+  BookField("totPMTSene", &totPMTSene);
+  BookField("totPMTCene", &totPMTCene);
+  BookField("PMTS_X", &PMTS_X);
+  BookField("PMTS_Y", &PMTS_Y);
+  BookField("PMTS_RMSX", &PMTS_RMSX);
+  BookField("PMTS_RMSY", &PMTS_RMSY);
+  BookField("PMTC_X", &PMTC_X);
+  BookField("PMTC_Y", &PMTC_Y);
+  BookField("PMTC_RMSX", &PMTC_RMSX);
+  BookField("PMTC_RMSY", &PMTC_RMSY);
+  BookField("totSiPMSene", &totSiPMSene);
+  BookField("totSiPMCene", &totSiPMCene);
+  BookField("SiPMSene_module", &SiPMSene_module);
+  BookField("SiPMCene_module", &SiPMCene_module);
+  BookField("SiPMS_X", &SiPMS_X);
+  BookField("SiPMS_Y", &SiPMS_Y);
+  BookField("SiPMS_RMSX", &SiPMS_RMSX);
+  BookField("SiPMS_RMSY", &SiPMS_RMSY);
+  BookField("SiPMC_X", &SiPMC_X);
+  BookField("SiPMC_Y", &SiPMC_Y);
+  BookField("SiPMC_RMSX", &SiPMC_RMSX);
+  BookField("SiPMC_RMSY", &SiPMC_RMSY);
+  BookField("totLeakage", &totLeakage);
+  if (m_doDualReadout){
+    BookField("totPMTDRene", &totPMTDRene);
+    BookField("totSiPMDRene", &totSiPMDRene);
+  }
+
+  if (m_ntuple) m_ntuple->Open(m_ntupleName, *m_ntupleFile);
+
+  BuildPMTAuxPlan();
+  BuildDerivedGeometry();
    
   m_eventNumber = 0;
   m_triggerMask = 0;
 
   m_ADCs.fill(0.);
+  m_ADCs_ped.fill(0.);
+  m_ADCs_pedIQR.fill(0.);
   m_SiPM_HG.fill(0.);
   m_SiPM_LG.fill(0.);
   m_PMT.fill(0.);
@@ -154,103 +446,189 @@ bool PhysicsHelper::PrepareForRun()
 
 bool PhysicsHelper::DeterminePMTAuxPedestals(unsigned int l_option)
 {
-  if (l_option == 0){ // Pedestal are computed at run level
-    
-    // Use std::vectors to determine pedestals. It shoudl be fine memory-wise
-    // Let's say we have a run with 500 k events (gross overestimate)
-    // For 300 channels, and one pedestal every 10 events, this is 300 * 50k * 4 Byte = 60 MB
-    // implement a hard cap on the number of events anyway
-    
-    Long64_t nentries = m_PMTTree->GetEntries();
-    // estimate the number of pedestals
-    Long64_t nped = nentries/10;
-    
-    std::cout << "Evaluating pedestals for PMT and auxiliary detectors" << std::endl;
-    
-    if (nped>10000) {
-      std::cerr << "\n\n\n \033[33mWarning: the run contains more than 100k events. \nOnly the first 100k will be used to evaluate the pedestals\033[0m\n\n\n" << std::endl;
-      nentries = 100000;
-    }
+  if (l_option > 1){
+    std::cout << "PhysicsHelper::DeterminePMTAuxPedestals: l_option > 1 not implemented so far" << std::endl;
+    return false;
+  }
+  const bool l_local = (l_option == 1);
+  if (l_local && m_pedWindow <= 0){
+    std::cerr << "PhysicsHelper::DeterminePMTAuxPedestals: the pedestal window must have at least one entry" << std::endl;
+    return false;
+  }
 
-    std::vector<float> l_ped[N_PHELP_ADC];
-    for (unsigned int ch = 0; ch < N_PHELP_ADC; ++ch){
-      l_ped[ch].reserve(1000);
-    }
+  // Only the branches used in the selection are read (with the addresses set in PrepareForRun),
+  // TDCsval and ADCs only for the pedestal events
+  TBranch * l_maskBranch = m_PMTTree->GetBranch("TriggerMask");
+  TBranch * l_tdcBranch = m_PMTTree->GetBranch("TDCsval");
+  TBranch * l_adcBranch = m_PMTTree->GetBranch("ADCs");
+  if (!l_maskBranch || !l_tdcBranch || !l_adcBranch){
+    std::cerr << "PhysicsHelper::DeterminePMTAuxPedestals: the PMT tree has no TriggerMask, TDCsval or ADCs branch" << std::endl;
+    return false;
+  }
 
-    nped = 0;
-    
-    for (Long64_t ev = 0; ev < nentries; ++ev) {// Loop to get the pedestal events
-      m_PMTTree->GetEntry(ev);
-      if (m_triggerMask == 2){//pedestal event
-	if (m_TDCsval[15] > 1200){// As per Turra & Seghezzi selection
-	  for (unsigned int ch = 0; ch < N_PHELP_ADC; ++ch){
-	    l_ped[ch].push_back(m_ADCs[ch]);
-	  }
-	  ++nped;
-	}
-      }
-    }
+  const Long64_t nentries = m_PMTTree->GetEntries();
+  std::cout << "Evaluating pedestals for PMT and auxiliary detectors";
+  if (l_local) std::cout << " in windows of " << m_pedWindow << " events";
+  std::cout << std::endl;
+
+  ADCHistograms l_run;
+  std::unique_ptr<ADCHistograms> l_window(l_local ? new ADCHistograms() : NULL);
+  std::vector<bool> l_fewPeds; // windows which will take the run pedestals
+  m_localPeds.clear();
+  m_currentPedWindow = -1;
 
-    if (nped == 0){
-      std::cerr << "\n\n\n \033[33mWarning: the number of pedestal events used to estimate the PMT and aux pedestals is zero. The pedestal cannot be evaluated." << std::endl;
-      return true;
+  for (Long64_t ev = 0; ev < nentries; ++ev) {// Loop to get the pedestal events
+    if (l_local && ev > 0 && ev % m_pedWindow == 0){
+      m_localPeds.emplace_back();
+      for (unsigned int ch = 0; ch < N_PHELP_ADC; ++ch) m_localPeds.back()[ch] = l_window->Median(ch);
+      l_fewPeds.push_back(l_window->GetN() < MIN_LOCAL_PEDESTALS);
+      l_window->Clear();
     }
+    l_maskBranch->GetEntry(ev);
+    if (m_triggerMask != 2) continue; //pedestal event
+    l_tdcBranch->GetEntry(ev);
+    if (m_TDCsval[15] <= 1200) continue; // As per Turra & Seghezzi selection
+    l_adcBranch->GetEntry(ev);
+    l_run.Fill(m_ADCs);
+    if (l_local) l_window->Fill(m_ADCs);
+  }
+  if (l_local && nentries > 0){
+    m_localPeds.emplace_back();
+    for (unsigned int ch = 0; ch < N_PHELP_ADC; ++ch) m_localPeds.back()[ch] = l_window->Median(ch);
+    l_fewPeds.push_back(l_window->GetN() < MIN_LOCAL_PEDESTALS);
+  }
+
+  const Long64_t nped = l_run.GetN();
+  if (nped == 0){
+    std::cerr << "\n\n\n \033[33mWarning: the number of pedestal events used to estimate the PMT and aux pedestals is zero. The pedestal cannot be evaluated." << std::endl;
+    m_localPeds.clear();
+    return true;
+  }
     
-    if (nped < 50){
-      std::cerr << "\n\n\n \033[33mWarning: the number of pedestal events used to estimate the PMT and aux pedestals is low: nped = " << nped << " \033[0m\n\n\n" << std::endl;
-    }
-    // Compute the median
+  if (nped < 50){
+    std::cerr << "\n\n\n \033[33mWarning: the number of pedestal events used to estimate the PMT and aux pedestals is low: nped = " << nped << " \033[0m\n\n\n" << std::endl;
+  }
+  if (l_run.GetNOutside() > 0){
+    std::cerr << "PhysicsHelper::DeterminePMTAuxPedestals: " << l_run.GetNOutside() << " pedestal ADC values outside [" << PED_ADC_MIN << ", " << PED_ADC_MAX << "], counted at the edges" << std::endl;
+  }
 
+  for (unsigned int ch = 0; ch < N_PHELP_ADC; ++ch){
+    m_ADCs_ped[ch] = l_run.Median(ch);
+    m_ADCs_pedIQR[ch] = l_run.IQR(ch);
+  }
+  FillPMTPedestals(m_ADCs_ped);
 
-    
-    for (unsigned int ch = 0; ch < N_PHELP_ADC; ++ch){
-      std::nth_element(l_ped[ch].begin(), l_ped[ch].begin() + l_ped[ch].size()/2, l_ped[ch].end());
-      m_ADCs_ped[ch] = Float_t(l_ped[ch][l_ped[ch].size()/2]);
-      PMTCaloMapping::HWLoc l_hwloc(ch);
-      if (l_hwloc.is_valid(ch)){ // The channel actually corresponds to something
-	if (PMTCaloMapping::getIdxFromHWLoc(l_hwloc, m_runnumber) != 192){ // This something is a PMT
-	  m_pmtcal.FillPMTPed(PMTCaloMapping::getIdxFromHWLoc(l_hwloc, m_runnumber),m_ADCs_ped[ch]);
-	}
-      }
+  if (l_local){
+    const Long64_t l_nFew = std::count(l_fewPeds.begin(), l_fewPeds.end(), true);
+    for (std::size_t k = 0; k < m_localPeds.size(); ++k){
+      if (l_fewPeds[k]) m_localPeds[k] = m_ADCs_ped;
     }
-    
-  } else { // if (l_option == 0) --> no other option implemented so far
-    std::cout << "PhysicsHelper::DeterminePMTAuxPedestals: l_option != 0 not implemented so far" << std::endl;
-    return false;
+    std::cout << "Local pedestals in " << m_localPeds.size() << " windows, " << l_nFew << " of them with less than " << MIN_LOCAL_PEDESTALS << " pedestal events use the run pedestals" << std::endl;
   }
   return true;
 }
+
+void PhysicsHelper::FillPMTPedestals(const std::array<Float_t,N_PHELP_ADC> & l_ped)
+{
+  for (unsigned int ch = 0; ch < N_PHELP_ADC; ++ch){
+    PMTCaloMapping::HWLoc l_hwloc(ch);
+    if (l_hwloc.is_valid(ch)){ // The channel actually corresponds to something
+      if (PMTCaloMapping::getIdxFromHWLoc(l_hwloc, m_runnumber) != 192){ // This something is a PMT
+	m_pmtcal.FillPMTPed(PMTCaloMapping::getIdxFromHWLoc(l_hwloc, m_runnumber),l_ped[ch]);
+      }
+    }
+  }
+}
+
+void PhysicsHelper::UpdatePMTAuxPedestals(Long64_t ev)
+{
+  if (m_localPeds.empty()) return;
+  const Long64_t l_window = std::min<Long64_t>(ev / m_pedWindow, m_localPeds.size() - 1);
+  if (l_window != m_currentPedWindow){
+    FillPMTPedestals(m_localPeds[l_window]);
+    m_currentPedWindow = l_window;
+  }
+}
+
+const std::array<Float_t,N_PHELP_ADC> & PhysicsHelper::CurrentADCPedestals() const
+{
+  return (m_localPeds.empty() || m_currentPedWindow < 0) ? m_ADCs_ped : m_localPeds[m_currentPedWindow];
+}
   
 bool PhysicsHelper::DetermineSiPMPedestals()
 {return true;}
 
-bool PhysicsHelper::CalibratePMTAux()
+void PhysicsHelper::BuildPMTAuxPlan()
 {
+  // The mapping depends on the run only: it is looked up once here
+  m_planADC.clear();
+  m_planPMT.clear();
   for (unsigned int ch = 0; ch < N_PHELP_ADC; ++ch){
     PMTCaloMapping::HWLoc l_hwloc(ch);
     if (l_hwloc.is_valid(ch)){ // The channel actually corresponds to something
       unsigned int l_idx = PMTCaloMapping::getIdxFromHWLoc(l_hwloc, m_runnumber);
-      if (l_idx != 192){ // This something is a PMT // calibrate it
-	m_PMT[l_idx] = m_pmtcal.GetADCtoGeV(l_idx)*(m_ADCs[ch] - m_pmtcal.GetPMTPed(l_idx));
+      if (l_idx != 192 && l_idx < N_PHELP_PMT){ // This something is a PMT
+	m_planADC.push_back(ch);
+	m_planPMT.push_back(l_idx);
       }
-    } 
-    PShower = m_ADCs[31];
-    Veto = m_ADCs[63];
-    MCounter = m_ADCs[61];
-    C1 = m_ADCs[162];
-    C2 = m_ADCs[163];
-    C3 = m_ADCs[164];
-    TailC = m_ADCs[160];
-    L02 = m_ADCs[128];
-    L03 = m_ADCs[129];
-    L04 = m_ADCs[130];
-    L05 = m_ADCs[131];
-    L07 = m_ADCs[132];
-    L08 = m_ADCs[133];
-    if (m_runnumber >=484) L08 = m_ADCs[136];
-    L09 = m_ADCs[134];
-    L10 = m_ADCs[135];
+    }
+  }
+  m_planPed.assign(m_planADC.size(), 0.);
+  m_planGain.assign(m_planADC.size(), 1.);
+  UpdatePMTAuxPlan();
+
+  m_auxChannels = {
+    {&PShower, 31}, {&Veto, 63}, {&MCounter, 61},
+    {&C1, 162}, {&C2, 163}, {&C3, 164}, {&TailC, 160},
+    {&L02, 128}, {&L03, 129}, {&L04, 130}, {&L05, 131}, {&L07, 132},
+    {&L08, m_runnumber >= 484 ? 136u : 133u},
+    {&L09, 134}, {&L10, 135}
+  };
+  m_leakageADC.clear();
+  for (Float_t * l_leakage : {&L02, &L03, &L04, &L05, &L07, &L08, &L09, &L10}){
+    for (const auto & l_aux : m_auxChannels){
+      if (l_aux.first == l_leakage) m_leakageADC.push_back(l_aux.second);
+    }
+  }
+}
+
+void PhysicsHelper::BuildDerivedGeometry()
+{
+  for (unsigned int idx = 0; idx < N_PHELP_PMT; ++idx){
+    const PMTCaloMapping::PhysInfo l_info = PMTCaloMapping::getPhysInfoFromIdx(idx);
+    m_PMTX[idx] = l_info.x;
+    m_PMTY[idx] = l_info.y;
+    m_PMTIsS[idx] = (l_info.type == 'S') ? 1. : 0.;
+  }
+  const SiPMCaloMapping::GeometryTables & l_sipm = SiPMCaloMapping::getGeometryTables(m_runnumber);
+  for (unsigned int idx = 0; idx < N_PHELP_SIPM; ++idx) m_SiPMIsS[idx] = (l_sipm.type[idx] == 'S') ? 1. : 0.;
+  // The channels of a board are all in the same module
+  for (unsigned int board = 0; board < N_PHELP_BOARDS; ++board) m_SiPMBoardModule[board] = l_sipm.module[board * N_PHELP_SIPM_PER_BOARD] - 1;
+}
+
+void PhysicsHelper::UpdatePMTAuxPlan()
+{
+  for (std::size_t k = 0; k < m_planPMT.size(); ++k){
+    m_planPed[k] = m_pmtcal.GetPMTPed(m_planPMT[k]);
+    m_planGain[k] = m_pmtcal.GetADCtoGeV(m_planPMT[k]);
+  }
+  m_planVersion = m_pmtcal.GetVersion();
+}
+
+bool PhysicsHelper::CalibratePMTAux()
+{
+  // Constants changed since the last event (e.g. filled from python, or local pedestals)
+  if (m_planVersion != m_pmtcal.GetVersion()) UpdatePMTAuxPlan();
+
+  const std::size_t l_nPlan = m_planADC.size();
+  const UInt_t * l_adc = m_planADC.data();
+  const UInt_t * l_pmt = m_planPMT.data();
+  const Float_t * l_ped = m_planPed.data();
+  const Float_t * l_gain = m_planGain.data();
+  for (std::size_t k = 0; k < l_nPlan; ++k){
+    m_PMT[l_pmt[k]] = l_gain[k]*(m_ADCs[l_adc[k]] - l_ped[k]);
   }
+  for (const auto & l_aux : m_auxChannels) *l_aux.first = m_ADCs[l_aux.second];
 
   return true;
 }
@@ -283,48 +661,310 @@ bool PhysicsHelper::CalibrateDWC()
 
 bool PhysicsHelper::CalibrateSiPMs()
 {
-  int boardID = -1;
+  for (unsigned int board = 0; board < N_PHELP_BOARDS; ++board){
+    const unsigned int l_first = board * N_PHELP_SIPM_PER_BOARD;
+    if (m_BoardTimeStamps[board] <= 0){ // The board is not written, skip
+      std::fill(m_SiPM.begin() + l_first, m_SiPM.begin() + l_first + N_PHELP_SIPM_PER_BOARD, 0.f);
+    } else {
+      m_sipmcal.CalibrateBoard(board, m_SiPM_HG.data() + l_first, m_SiPM_LG.data() + l_first, m_SiPM.data() + l_first);
+    }
+  }
+  return true;
+}
+
+bool PhysicsHelper::ComputeDerivedQuantities()
+{
+  MomentLanes l_pmt;
+  l_pmt.Add(m_PMT.data(), m_PMTX.data(), m_PMTY.data(), m_PMTIsS.data(), N_PHELP_PMT, l_pmt.e);
+  totPMTSene = MomentLanes::Sum(l_pmt.e[0]);
+  totPMTCene = MomentLanes::Sum(l_pmt.e[1]);
+  l_pmt.Shower(0, PMTS_X, PMTS_Y, PMTS_RMSX, PMTS_RMSY);
+  l_pmt.Shower(1, PMTC_X, PMTC_Y, PMTC_RMSX, PMTC_RMSY);
+
+  // One pass over the boards: the energy sums go to the module of the board, the moments to the whole detector
+  const SiPMCaloMapping::GeometryTables & l_sipm = SiPMCaloMapping::getGeometryTables(m_runnumber);
+  MomentLanes l_sipmMoments;
+  alignas(64) Float_t l_modules[N_PHELP_SIPM_MODULES][2][MOMENT_LANES] = {};
+  for (unsigned int board = 0; board < N_PHELP_BOARDS; ++board){
+    const unsigned int l_first = board * N_PHELP_SIPM_PER_BOARD;
+    l_sipmMoments.Add(m_SiPM.data() + l_first, l_sipm.x.data() + l_first, l_sipm.y.data() + l_first, m_SiPMIsS.data() + l_first,
+		      N_PHELP_SIPM_PER_BOARD, l_modules[m_SiPMBoardModule[board]]);
+  }
+  double l_totS = 0., l_totC = 0.;
+  for (unsigned int mod = 0; mod < N_PHELP_SIPM_MODULES; ++mod){
+    const double l_modS = MomentLanes::Sum(l_modules[mod][0]);
+    const double l_modC = MomentLanes::Sum(l_modules[mod][1]);
+    SiPMSene_module[mod] = l_modS;
+    SiPMCene_module[mod] = l_modC;
+    l_totS += l_modS;
+    l_totC += l_modC;
+  }
+  totSiPMSene = l_totS;
+  totSiPMCene = l_totC;
+  l_sipmMoments.Shower(0, SiPMS_X, SiPMS_Y, SiPMS_RMSX, SiPMS_RMSY);
+  l_sipmMoments.Shower(1, SiPMC_X, SiPMC_Y, SiPMC_RMSX, SiPMC_RMSY);
 
-  //std::cout << "----------------------------" << std::endl;
-  //std::cout << "Event number " << m_eventNumber << std::endl;
-  
-  for (unsigned int ch = 0; ch < N_PHELP_SIPM; ++ch)
-    {
+  // Leakage counters, with the pedestals used for the PMTs of this event
+  const std::array<Float_t,N_PHELP_ADC> & l_ped = CurrentADCPedestals();
+  double l_leakage = 0.;
+  for (UInt_t ch : m_leakageADC) l_leakage += m_ADCs[ch] - l_ped[ch];
+  totLeakage = l_leakage;
 
-      boardID = ch/64;
-      //      std::cout << "Channel " << ch << " boardID " << boardID << " timeStamp " << m_BoardTimeStamps[boardID] << std::endl;
-      if (m_BoardTimeStamps[boardID] <=0){ // The board is not written, skip
-	m_SiPM[ch] = 0.;
-      } else{
-	if (m_SiPM_HG[ch] > 3800){
-	  // compute HGfromLG
-	  m_SiPM[ch] = m_sipmcal.GetHGfromLG_m(ch) * (float(m_SiPM_LG[ch]) - float(m_sipmcal.GetADCPedLG(ch))) + m_sipmcal.GetHGfromLG_q(ch);
-	} else {
-	  m_SiPM[ch] = float(m_SiPM_HG[ch]) - m_sipmcal.GetADCPedHG(ch);
-	}
-	// Now rescale for the relevant ADCtoGeV factor
-	//std::cout << m_sipmcal.GetADCtoGeV(ch) << std::endl;
-	m_SiPM[ch] = m_sipmcal.GetADCtoGeV(ch) * float(m_SiPM[ch]);
-      }
-    }
-  
   return true;
 }
 
+bool PhysicsHelper::CalibrateDualReadout()
+{
+  if (m_drcal.chiPMT == 1. || m_drcal.chiSiPM == 1.){
+    std::cerr << "PhysicsHelper::CalibrateDualReadout: chi is 1 (PMT " << m_drcal.chiPMT << ", SiPM " << m_drcal.chiSiPM << "), the dual-readout energy is not defined" << std::endl;
+    return false;
+  }
+  // a NaN chi propagates to its section only
+  totPMTDRene = (totPMTSene - m_drcal.chiPMT * totPMTCene) / (1. - m_drcal.chiPMT);
+  totSiPMDRene = (totSiPMSene - m_drcal.chiSiPM * totSiPMCene) / (1. - m_drcal.chiSiPM);
+  return true;
+}
+
+bool PhysicsHelper::FitDualReadoutChi(Long64_t nEntries)
+{
+  const DRChiFitSelection & l_sel = m_drfit;
+  if (!(l_sel.beamEnergy > 0)){
+    std::cerr << "PhysicsHelper::FitDualReadoutChi: no beam energy given, chi is not fitted" << std::endl;
+    return false;
+  }
+  TBranch * l_maskBranch = m_PMTTree->GetBranch("TriggerMask");
+  if (!l_maskBranch){
+    std::cerr << "PhysicsHelper::FitDualReadoutChi: the PMT tree has no TriggerMask branch" << std::endl;
+    return false;
+  }
+
+  // Pedestal-subtracted value of an auxiliary detector, for the cuts
+  auto l_aux = [this](const Float_t * l_detector){
+    for (const auto & l_channel : m_auxChannels){
+      if (l_channel.first == l_detector) return *l_detector - CurrentADCPedestals()[l_channel.second];
+    }
+    return *l_detector;
+  };
+  auto l_above = [](double l_value, double l_cut){return l_cut >= 0 && l_value > l_cut;};
+  auto l_below = [](double l_value, double l_cut){return l_cut >= 0 && l_value < l_cut;};
+
+  // Sums for the fits: n, 1 - S/E, 1 - C/E, for [0] PMT and [1] SiPM
+  std::array<std::array<double,3>,2> l_sums{};
+  Long64_t nentries = m_PMTTree->GetEntries();
+  if (nEntries >= 0) nentries = std::min(nentries, nEntries);
+  std::cout << "Fitting chi on " << nentries << " events, beam energy " << l_sel.beamEnergy << " GeV" << std::endl;
+
+  for (Long64_t ev = 0; ev < nentries; ++ev){
+    // The pedestal events are recognised reading TriggerMask only
+    l_maskBranch->GetEntry(ev);
+    if (m_triggerMask == 2) continue; // pedestal event
+    m_PMTTree->GetEntry(ev);
+    m_SiPMTree->GetEntry(ev);
+    UpdatePMTAuxPedestals(ev);
+    if (!CalibratePMTAux() || !CalibrateSiPMs() || !ComputeDerivedQuantities()){
+      std::cerr << "PhysicsHelper::FitDualReadoutChi: problems in running calibration at event " << m_eventNumber << std::endl;
+      return false;
+    }
+    if (l_above(l_aux(&PShower), l_sel.maxPShower) || l_above(l_aux(&MCounter), l_sel.maxMCounter) ||
+	l_below(l_aux(&C1), l_sel.minC1) || l_above(l_aux(&C1), l_sel.maxC1) ||
+	l_below(l_aux(&C2), l_sel.minC2) || l_above(l_aux(&C2), l_sel.maxC2) ||
+	l_above(totLeakage, l_sel.maxLeakage)) continue;
+    const double l_S[2] = {totPMTSene, totSiPMSene};
+    const double l_C[2] = {totPMTCene, totSiPMCene};
+    const double l_total = l_S[0] + l_C[0] + l_S[1] + l_C[1];
+    if (l_total < 2. * l_sel.minEnergyFraction * l_sel.beamEnergy || l_total > 2. * l_sel.maxEnergyFraction * l_sel.beamEnergy) continue;
+    for (unsigned int k = 0; k < 2; ++k){
+      if (l_S[k] + l_C[k] < l_sel.minSectionFraction * l_total) continue;
+      l_sums[k][0] += 1.;
+      l_sums[k][1] += 1. - l_S[k] / l_sel.beamEnergy;
+      l_sums[k][2] += 1. - l_C[k] / l_sel.beamEnergy;
+    }
+  }
+
+  bool l_good = true;
+  const char * l_names[2] = {"PMT", "SiPM"};
+  Double_t * l_chis[2] = {&m_drcal.chiPMT, &m_drcal.chiSiPM};
+  for (unsigned int k = 0; k < 2; ++k){
+    const double n = l_sums[k][0];
+    if (n < MIN_CHI_FIT_EVENTS || !(l_sums[k][2] > 0)){
+      std::cerr << "PhysicsHelper::FitDualReadoutChi: " << Long64_t(n) << " selected events in the " << l_names[k] << " section, keeping chi = " << *l_chis[k] << std::endl;
+      l_good = false;
+      continue;
+    }
+    const double l_chi = l_sums[k][1] / l_sums[k][2];
+    if (!(l_chi < 1.)){
+      std::cerr << "PhysicsHelper::FitDualReadoutChi: fitted " << l_names[k] << " chi " << l_chi << " is not below 1, keeping chi = " << *l_chis[k] << std::endl;
+      l_good = false;
+      continue;
+    }
+    *l_chis[k] = l_chi;
+    std::cout << "Fitted " << l_names[k] << " chi = " << l_chi << " on " << Long64_t(n) << " events" << std::endl;
+  }
+  return l_good;
+}
+
 void PhysicsHelper::Loop()
 {
+  if (m_nThreads > 1 && LoopParallel()) return;
+
   Long64_t nentries = m_PMTTree->GetEntries();
   for (Long64_t ev = 0; ev < nentries; ++ev) {// Loop to get the pedestal events
     if (ev % 10000 == 0) std::cout << ev << " events processed" << std::endl;
     m_PMTTree->GetEntry(ev);
     m_SiPMTree->GetEntry(ev);
-    if (!CalibratePMTAux() || !CalibrateDWC() || !CalibrateSiPMs()){
+    UpdatePMTAuxPedestals(ev);
+    if (!CalibratePMTAux() || !CalibrateDWC() || !CalibrateSiPMs() || !ComputeDerivedQuantities()
+	|| (m_doDualReadout && !CalibrateDualReadout())){
       std::cout << "Event " << m_eventNumber << ": problems in running calibration, exitiing the loop." << std::endl;
       break;
     }
-    m_newTree->Fill();
+    if (m_ntuple) m_ntuple->Fill();
+    else m_newTree->Fill();
+  }
+}
+
+bool PhysicsHelper::ProcessBatch(Long64_t first, Long64_t last, std::vector<char> & l_records)
+{
+  l_records.reserve(l_records.size() + (last - first) * m_recordSize);
+  for (Long64_t ev = first; ev < last; ++ev){
+    m_PMTTree->GetEntry(ev);
+    m_SiPMTree->GetEntry(ev);
+    UpdatePMTAuxPedestals(ev);
+    if (!CalibratePMTAux() || !CalibrateDWC() || !CalibrateSiPMs() || !ComputeDerivedQuantities()
+	|| (m_doDualReadout && !CalibrateDualReadout())){
+      std::cout << "Event " << m_eventNumber << ": problems in running calibration, exitiing the loop." << std::endl;
+      return false;
+    }
+    for (const auto & l_field : m_outputFields){
+      const char * l_begin = static_cast<const char *>(l_field.first);
+      l_records.insert(l_records.end(), l_begin, l_begin + l_field.second);
+    }
   }
+  return true;
 }
 
+bool PhysicsHelper::LoopParallel()
+{
+  TFile * l_PMTFile = m_PMTTree->GetCurrentFile();
+  TFile * l_SiPMFile = m_SiPMTree->GetCurrentFile();
+  if (!l_PMTFile || !l_SiPMFile){
+    std::cerr << "PhysicsHelper::Loop: the input trees are not read from a file, running on one thread" << std::endl;
+    return false;
+  }
+  ROOT::EnableThreadSafety();
+
+  // Every worker has its own input trees, buffers and copy of the calibration constants. They are set up here,
+  // so that nothing is written if one of them cannot be
+  const unsigned int l_nWorkers = m_nThreads;
+  std::vector<std::unique_ptr<TFile>> l_files;
+  std::vector<std::unique_ptr<PhysicsHelper>> l_workers;
+  for (unsigned int t = 0; t < l_nWorkers; ++t){
+    l_files.emplace_back(TFile::Open(l_PMTFile->GetName(), "READ"));
+    l_files.emplace_back(TFile::Open(l_SiPMFile->GetName(), "READ"));
+    TTree * l_PMTTree = NULL;
+    TTree * l_SiPMTree = NULL;
+    if (l_files[2*t]) l_files[2*t]->GetObject(m_PMTTree->GetName(), l_PMTTree);
+    if (l_files[2*t+1]) l_files[2*t+1]->GetObject(m_SiPMTree->GetName(), l_SiPMTree);
+    if (!l_PMTTree || !l_SiPMTree){
+      std::cerr << "PhysicsHelper::Loop: cannot read the input trees again for a worker thread, running on one thread" << std::endl;
+      return false;
+    }
+    l_workers.emplace_back(new PhysicsHelper(m_runnumber, NULL, l_PMTTree, l_SiPMTree));
+    PhysicsHelper & l_worker = *l_workers.back();
+    l_worker.m_doDualReadout = m_doDualReadout;
+    l_worker.PrepareForRun();
+    l_worker.m_ADCs_ped = m_ADCs_ped;
+    l_worker.m_ADCs_pedIQR = m_ADCs_pedIQR;
+    l_worker.m_pedWindow = m_pedWindow;
+    l_worker.m_localPeds = m_localPeds;
+    l_worker.m_pmtcal = m_pmtcal;
+    l_worker.m_dwccal = m_dwccal;
+    l_worker.m_sipmcal = m_sipmcal;
+    l_worker.m_drcal = m_drcal;
+    l_worker.UpdatePMTAuxPlan();
+  }
+  if (l_workers.front()->m_recordSize != m_recordSize){
+    std::cerr << "PhysicsHelper::Loop: the output fields of the workers differ from the booked ones, running on one thread" << std::endl;
+    return false;
+  }
+
+  // Worker t calibrates the batches t, t + l_nWorkers, ... and queues them: the batches are written in order
+  // by taking them from the workers in turn
+  struct Batch
+  {
+    std::vector<char> records;
+    bool good;
+  };
+  struct WorkerQueue
+  {
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<Batch> ready;
+  };
+  std::vector<WorkerQueue> l_queues(l_nWorkers);
+  std::atomic<bool> l_stop(false);
+
+  const Long64_t nentries = m_PMTTree->GetEntries();
+  const Long64_t l_nBatches = (nentries + BATCH_SIZE - 1) / BATCH_SIZE;
+  std::cout << "PhysicsHelper::Loop: " << nentries << " events in " << l_nBatches << " batches, on " << l_nWorkers << " threads" << std::endl;
+
+  std::vector<std::thread> l_threads;
+  for (unsigned int t = 0; t < l_nWorkers; ++t){
+    l_threads.emplace_back([&, t](){
+      WorkerQueue & l_queue = l_queues[t];
+      for (Long64_t b = t; b < l_nBatches; b += l_nWorkers){
+	{
+	  std::unique_lock<std::mutex> l_lock(l_queue.mutex);
+	  l_queue.cond.wait(l_lock, [&](){return l_queue.ready.size() < MAX_READY_BATCHES || l_stop;});
+	}
+	if (l_stop) return;
+	Batch l_batch;
+	l_batch.good = l_workers[t]->ProcessBatch(b * BATCH_SIZE, std::min(nentries, (b + 1) * BATCH_SIZE), l_batch.records);
+	const bool l_good = l_batch.good;
+	{
+	  std::lock_guard<std::mutex> l_lock(l_queue.mutex);
+	  l_queue.ready.push_back(std::move(l_batch));
+	}
+	l_queue.cond.notify_all();
+	if (!l_good) return;
+      }
+    });
+  }
 
+  Long64_t ev = 0;
+  for (Long64_t b = 0; b < l_nBatches && !l_stop; ++b){
+    WorkerQueue & l_queue = l_queues[b % l_nWorkers];
+    Batch l_batch;
+    {
+      std::unique_lock<std::mutex> l_lock(l_queue.mutex);
+      l_queue.cond.wait(l_lock, [&](){return !l_queue.ready.empty();});
+      l_batch = std::move(l_queue.ready.front());
+      l_queue.ready.pop_front();
+    }
+    l_queue.cond.notify_all();
+
+    for (const char * l_record = l_batch.records.data(); l_record < l_batch.records.data() + l_batch.records.size(); ++ev){
+      if (ev % 10000 == 0) std::cout << ev << " events processed" << std::endl;
+      for (const auto & l_field : m_outputFields){
+	std::memcpy(l_field.first, l_record, l_field.second);
+	l_record += l_field.second;
+      }
+      if (m_ntuple) m_ntuple->Fill();
+      else m_newTree->Fill();
+    }
+    if (!l_batch.good) l_stop = true;
+  }
 
+  for (WorkerQueue & l_queue : l_queues){
+    {
+      std::lock_guard<std::mutex> l_lock(l_queue.mutex);
+    }
+    l_queue.cond.notify_all();
+  }
+  for (std::thread & l_thread : l_threads) l_thread.join();
+
+  // The input trees of the workers belong to their files
+  l_workers.clear();
+  l_files.clear();
+  return true;
+}